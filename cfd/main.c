@@ -4,11 +4,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 // TODO: consider using: getprogname()
 #define PROGRAM_NAME "cfd"
@@ -25,7 +38,61 @@ static void *xalloc_die(void) {
 	abort();
 }
 
+// Benchmark statistics
+//
+// The number of allocations made through xmalloc and xrealloc, and the
+// time spent in each phase of sorting (when bench_phases is not NULL), are
+// reported by --bench. Allocations made by libc (e.g. getdelim and stdio
+// buffers) are not counted so they are reported as "xallocs". The counters
+// are updated with relaxed atomics since the sort threads allocate as well.
+
+static size_t alloc_calls = 0;
+static size_t alloc_bytes = 0;
+
+typedef enum {
+	PHASE_READ,  // reading lines (including PHASE_STRIP)
+	PHASE_STRIP, // building comparison strings
+	PHASE_SORT,
+	PHASE_WRITE,
+	PHASE_FREE,
+	PHASE_COUNT,
+} bench_phase;
+
+static const char *const bench_phase_names[PHASE_COUNT] = {
+	[PHASE_READ]  = "read",
+	[PHASE_STRIP] = "strip",
+	[PHASE_SORT]  = "sort",
+	[PHASE_WRITE] = "write",
+	[PHASE_FREE]  = "free",
+};
+
+// Nanoseconds spent in each phase, NULL unless a phase breakdown is being
+// collected since timing every line is not free.
+static int64_t *bench_phases = NULL;
+
+static int64_t monotonic_nanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static inline int64_t phase_start(void) {
+	return bench_phases ? monotonic_nanos() : 0;
+}
+
+static inline void phase_end(bench_phase phase, int64_t start) {
+	if (bench_phases) {
+		bench_phases[phase] += monotonic_nanos() - start;
+	}
+}
+
+static inline void count_alloc(size_t n) {
+	__atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc_bytes, n, __ATOMIC_RELAXED);
+}
+
 static void *xmalloc(size_t n) {
+	count_alloc(n);
 	void *p = malloc(n);
 	if (!p && n != 0) {
 		xalloc_die();
@@ -38,6 +105,7 @@ static void *xrealloc(void *p, size_t n) {
 		free(p);
 		return NULL;
 	}
+	count_alloc(n);
 	p = realloc(p, n);
 	if (!p && n) {
 		xalloc_die();
@@ -45,6 +113,50 @@ static void *xrealloc(void *p, size_t n) {
 	return p;
 }
 
+// Arena
+//
+// Lines are stored in large chunks that are allocated from the front (bump
+// allocation) and freed all at once. This replaces one malloc and free per
+// input line with one per ARENA_CHUNK_SIZE bytes of input.
+
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t             len;
+	size_t             cap;
+	char               data[];
+} arena_chunk;
+
+typedef struct {
+	arena_chunk *head; // current chunk, older chunks are linked via next
+} arena;
+
+static char *arena_alloc(arena *a, size_t n) {
+	arena_chunk *c = a->head;
+	if (!c || c->cap - c->len < n) {
+		size_t cap = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+		c = xmalloc(sizeof(arena_chunk) + cap);
+		c->len = 0;
+		c->cap = cap;
+		c->next = a->head;
+		a->head = c;
+	}
+	char *p = &c->data[c->len];
+	c->len += n;
+	return p;
+}
+
+static void arena_free(arena *a) {
+	arena_chunk *c = a->head;
+	while (c) {
+		arena_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	a->head = NULL;
+}
+
 typedef struct {
 	char   *line;
 	size_t line_len;
@@ -52,267 +164,1889 @@ typedef struct {
 	size_t comp_len;
 } line_buffer;
 
-#define CONCATX(x, y)      x##y
-#define CONCAT(x, y)       CONCATX(x, y)
-#define UNIQUE_ALIAS(name) CONCAT(name, __COUNTER__)
+// CEV: We can't just return `_l1 - _l2` here since we're casting to an int
+// and in the unlikely event that we have multi GB lines it will overflow.
+#define CMP_LEN(_l1, _l2) (_l1) == (_l2) ? 0 : (_l1) > (_l2) ? 1 : -1
+
+static inline int line_buffer_compare_strings(const void* p1, const void* p2) {
+	// TODO: handle non-ASCII characters
+	const line_buffer *b1 = (const line_buffer*)p1;
+	const line_buffer *b2 = (const line_buffer*)p2;
+	int ret = memcmp(b1->comp, b2->comp, b1->comp_len < b2->comp_len
+		? b1->comp_len : b2->comp_len);
+	return ret != 0 ? ret : CMP_LEN(b1->comp_len, b2->comp_len);
+}
+
+// Sort keys
+//
+// Lines are sorted through an array of compact keys that store the first 8
+// bytes of the comparison string (big-endian, so that integer order matches
+// memcmp order) along with a pointer to the line. Most comparisons are
+// decided by the prefix alone and never touch the line's memory, which is
+// scattered across the arena.
+//
+// Paths tend to share a long common prefix (e.g. "/home/user/src/...") that
+// would make every inline prefix equal, so the longest prefix shared by all
+// lines is skipped when building the keys.
+
+typedef struct {
+	uint64_t          prefix;
+	const line_buffer *line;
+} sort_key;
+
+// load_prefix returns the first (up to) 8 bytes of s as a big-endian
+// integer, zero padded if s is shorter than 8 bytes.
+static inline uint64_t load_prefix(const char *s, size_t n) {
+	uint64_t v = 0;
+	if (n >= sizeof(v)) {
+		memcpy(&v, s, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		v = __builtin_bswap64(v);
+#endif
+		return v;
+	}
+	for (size_t i = 0; i < n; i++) {
+		v |= (uint64_t)(unsigned char)s[i] << (56 - (i * 8));
+	}
+	return v;
+}
+
+// Case folding
+//
+// When sort_fold_case is set comparison strings are not lowered when they
+// are created, instead case is folded on the fly when comparing. This saves
+// a lower case copy of every line that contains upper case chars and
+// produces the same order. It is set once before sorting begins.
+static bool sort_fold_case = false;
+
+// fold_prefix folds the ASCII upper case bytes of a prefix loaded with
+// load_prefix to lower case, 8 bytes at a time.
+static inline uint64_t fold_prefix(uint64_t v) {
+	const uint64_t ones = 0x0101010101010101ULL;
+	uint64_t x = v & (0x7f * ones);
+	uint64_t ge_a = x + ((0x80 - 'A') * ones);     // high bit set if >= 'A'
+	uint64_t gt_z = x + ((0x80 - 'Z' - 1) * ones); // high bit set if > 'Z'
+	uint64_t upper = ge_a & ~gt_z & ~v & (0x80 * ones);
+	return v | (upper >> 2);
+}
+
+// line_buffer_compare_fold is line_buffer_compare_strings with ASCII case
+// folded. Identical words are skipped without folding them.
+__attribute__((__noinline__))
+static int line_buffer_compare_fold(const line_buffer *b1, const line_buffer *b2) {
+	size_t n = b1->comp_len < b2->comp_len ? b1->comp_len : b2->comp_len;
+	if (memcmp(b1->comp, b2->comp, n) == 0) {
+		return CMP_LEN(b1->comp_len, b2->comp_len);
+	}
+	for (size_t i = 0; i < n; i += 8) {
+		size_t m = n - i < 8 ? n - i : 8;
+		uint64_t v1 = load_prefix(&b1->comp[i], m);
+		uint64_t v2 = load_prefix(&b2->comp[i], m);
+		if (v1 != v2) {
+			v1 = fold_prefix(v1);
+			v2 = fold_prefix(v2);
+			if (v1 != v2) {
+				return v1 < v2 ? -1 : 1;
+			}
+		}
+	}
+	return CMP_LEN(b1->comp_len, b2->comp_len);
+}
+
+// line_buffer_compare compares the comparison strings of b1 and b2.
+static inline int line_buffer_compare(const line_buffer *b1, const line_buffer *b2) {
+	return sort_fold_case
+		? line_buffer_compare_fold(b1, b2)
+		: line_buffer_compare_strings(b1, b2);
+}
+
+// line_prefix returns the prefix of b's comparison string starting at off.
+static inline uint64_t line_prefix(const line_buffer *b, size_t off) {
+	uint64_t v = load_prefix(&b->comp[off], b->comp_len - off);
+	return sort_fold_case ? fold_prefix(v) : v;
+}
+
+// common_prefix_len returns the length of the common prefix of s1 and s2.
+static size_t common_prefix_len(const char *s1, const char *s2, size_t n) {
+	size_t i = 0;
+	while (i < n && s1[i] == s2[i]) {
+		i++;
+	}
+	return i;
+}
+
+static inline int sort_key_compare(const void *p1, const void *p2) {
+	const sort_key *k1 = (const sort_key *)p1;
+	const sort_key *k2 = (const sort_key *)p2;
+	if (k1->prefix != k2->prefix) {
+		return k1->prefix < k2->prefix ? -1 : 1;
+	}
+	int ret = line_buffer_compare(k1->line, k2->line);
+	if (ret != 0) {
+		return ret;
+	}
+	// Equal lines retain their input order (this matches glibc's qsort,
+	// which is a stable merge sort, and makes the output deterministic).
+	return k1->line == k2->line ? 0 : k1->line < k2->line ? -1 : 1;
+}
+
+// sort_key_equal returns if the comparison strings of k1 and k2 are equal.
+static inline bool sort_key_equal(const sort_key *k1, const sort_key *k2) {
+	return k1->prefix == k2->prefix && line_buffer_compare(k1->line, k2->line) == 0;
+}
+
+// make_sort_keys returns the sort keys for lines and stores the length of
+// the prefix common to all lines, which is excluded from the keys, in skip.
+static sort_key *make_sort_keys(const line_buffer *lines, size_t len, size_t *skip_out) {
+	size_t skip = len > 0 ? lines[0].comp_len : 0;
+	for (size_t i = 1; i < len && skip > 0; i++) {
+		size_t n = lines[i].comp_len < skip ? lines[i].comp_len : skip;
+		skip = common_prefix_len(lines[0].comp, lines[i].comp, n);
+	}
+	sort_key *keys = xmalloc(sizeof(sort_key) * len);
+	for (size_t i = 0; i < len; i++) {
+		keys[i] = (sort_key){
+			.prefix = line_prefix(&lines[i], skip),
+			.line   = &lines[i],
+		};
+	}
+	*skip_out = skip;
+	return keys;
+}
+
+// Radix sort
+//
+// Keys are sorted with an MSD radix sort (American flag sort) that
+// partitions on one byte of the inline prefix at a time. When a bucket has
+// consumed all 8 bytes of the prefix its keys are reloaded with the next 8
+// bytes of the comparison string, so the line's memory is only touched once
+// per 8 bytes of depth. Buckets smaller than RADIX_SORT_MIN_KEYS are
+// finished with qsort.
+//
+// Zero padding makes the prefix ambiguous for strings that end inside it
+// ("a" and "a\0" have the same prefix), but such keys always share a bucket
+// and when the prefix is reloaded the strings that ended are moved to the
+// front of the bucket and ordered with sort_key_compare.
+
+#define RADIX_SORT_MIN_KEYS 32
+
+// Maximum depth (in bytes), past this buckets are sorted with qsort (this
+// bounds the stack usage of radix_sort_depth).
+#define RADIX_SORT_MAX_DEPTH 256
+
+static inline unsigned radix_byte(const sort_key *k, size_t depth) {
+	return (k->prefix >> (56 - ((depth % 8) * 8))) & 0xff;
+}
+
+// radix_partition partitions keys in-place by their prefix byte at depth and
+// stores the start of each bucket in bounds (the end of bucket i is
+// bounds[i+1]).
+static void radix_partition(sort_key *keys, size_t len, size_t depth, size_t bounds[257]) {
+	size_t next[256];
+	size_t counts[256] = { 0 };
+	for (size_t i = 0; i < len; i++) {
+		counts[radix_byte(&keys[i], depth)]++;
+	}
+	bounds[0] = 0;
+	for (size_t b = 0; b < 256; b++) {
+		bounds[b + 1] = bounds[b] + counts[b];
+		next[b] = bounds[b];
+	}
+	for (size_t b = 0; b < 256; b++) {
+		while (next[b] < bounds[b + 1]) {
+			sort_key v = keys[next[b]];
+			unsigned c = radix_byte(&v, depth);
+			while (c != b) {
+				sort_key t = keys[next[c]];
+				keys[next[c]++] = v;
+				v = t;
+				c = radix_byte(&v, depth);
+			}
+			keys[next[b]++] = v;
+		}
+	}
+}
+
+// radix_reload loads the prefix of keys with the 8 bytes of the comparison
+// string that start at depth. Keys whose strings end before depth are moved
+// to the front and their number is returned.
+static size_t radix_reload(sort_key *keys, size_t len, size_t depth, size_t skip) {
+	size_t ended = 0;
+	for (size_t i = 0; i < len; i++) {
+		const line_buffer *b = keys[i].line;
+		size_t off = skip + depth;
+		if (b->comp_len <= off) {
+			keys[i].prefix = 0;
+			sort_key t = keys[ended];
+			keys[ended++] = keys[i];
+			keys[i] = t;
+		} else {
+			keys[i].prefix = line_prefix(b, off);
+		}
+	}
+	return ended;
+}
+
+// radix_sort_depth sorts keys that are equal up to depth and returns true
+// if the prefix of any key was reloaded.
+static bool radix_sort_depth(sort_key *keys, size_t len, size_t depth, size_t skip) {
+	bool reloaded = false;
+	while (len >= RADIX_SORT_MIN_KEYS && depth < RADIX_SORT_MAX_DEPTH) {
+		if (depth > 0 && depth % 8 == 0) {
+			size_t ended = radix_reload(keys, len, depth, skip);
+			reloaded = true;
+			if (ended > 1) {
+				qsort(keys, ended, sizeof(sort_key), sort_key_compare);
+			}
+			keys += ended;
+			len -= ended;
+			if (len < RADIX_SORT_MIN_KEYS) {
+				break;
+			}
+		}
+
+		size_t bounds[257];
+		radix_partition(keys, len, depth, bounds);
+
+		// Avoid recursing if every key fell into the same bucket, which is
+		// common for paths that share a directory.
+		size_t b = 0;
+		while (b < 256 && bounds[b + 1] - bounds[b] != len) {
+			b++;
+		}
+		if (b < 256) {
+			depth++;
+			continue;
+		}
+		for (b = 0; b < 256; b++) {
+			size_t n = bounds[b + 1] - bounds[b];
+			if (n > 1) {
+				reloaded |= radix_sort_depth(&keys[bounds[b]], n, depth + 1, skip);
+			}
+		}
+		return reloaded;
+	}
+	if (len > 1) {
+		qsort(keys, len, sizeof(sort_key), sort_key_compare);
+	}
+	return reloaded;
+}
+
+// radix_sort sorts keys created by make_sort_keys, skip is the length of
+// the common prefix that make_sort_keys excluded from the keys. The result
+// is the same as calling qsort with sort_key_compare.
+static void radix_sort(sort_key *keys, size_t len, size_t skip) {
+	if (radix_sort_depth(keys, len, 0, skip)) {
+		// Restore the original prefixes since they may be used to merge
+		// the keys with another sorted run.
+		for (size_t i = 0; i < len; i++) {
+			keys[i].prefix = line_prefix(keys[i].line, skip);
+		}
+	}
+}
+
+// Parallel sort
+//
+// Large inputs are sorted by splitting the keys into one run per thread,
+// sorting each run with radix_sort and then merging the runs pairwise. Every
+// merge round is split across all threads by partitioning the output with
+// a binary search (merge path) so that the final merge does not run on a
+// single core. Since sort_key_compare never reports two keys as equal the
+// result is identical to a single qsort of the whole input.
+
+// Inputs smaller than this are sorted by a single thread since the
+// cost of creating threads would outweigh any gains.
+#ifndef PARALLEL_SORT_MIN_KEYS
+#define PARALLEL_SORT_MIN_KEYS (64 * 1024)
+#endif
+
+// Upper bound on the number of sort threads.
+#define PARALLEL_SORT_MAX_THREADS 64
+
+typedef struct {
+	sort_key *keys;
+	size_t   len;
+	size_t   skip;
+} sort_task;
+
+typedef struct {
+	const sort_key *a;
+	size_t         a_len;
+	const sort_key *b;
+	size_t         b_len;
+	sort_key       *out;
+	size_t         lo; // first output index of this segment
+	size_t         hi; // one past the last output index of this segment
+} merge_task;
+
+static void *sort_task_run(void *arg) {
+	sort_task *t = arg;
+	radix_sort(t->keys, t->len, t->skip);
+	return NULL;
+}
+
+// merge_corank returns the number of elements of a that precede output
+// index k when a and b are merged (with ties resolved in favor of a).
+static size_t merge_corank(size_t k, const sort_key *a, size_t a_len,
+                           const sort_key *b, size_t b_len) {
+	size_t lo = k > b_len ? k - b_len : 0;
+	size_t hi = k < a_len ? k : a_len;
+	while (lo < hi) {
+		size_t i = lo + (hi - lo) / 2;
+		size_t j = k - i;
+		// a[i] belongs before b[j-1] so more elements of a are needed
+		if (j > 0 && i < a_len && sort_key_compare(&b[j - 1], &a[i]) >= 0) {
+			lo = i + 1;
+		} else {
+			hi = i;
+		}
+	}
+	return lo;
+}
+
+static void *merge_task_run(void *arg) {
+	merge_task *t = arg;
+	size_t i = merge_corank(t->lo, t->a, t->a_len, t->b, t->b_len);
+	size_t j = t->lo - i;
+	for (size_t k = t->lo; k < t->hi; k++) {
+		if (j == t->b_len || (i < t->a_len &&
+		    sort_key_compare(&t->a[i], &t->b[j]) <= 0)) {
+			t->out[k] = t->a[i++];
+		} else {
+			t->out[k] = t->b[j++];
+		}
+	}
+	return NULL;
+}
+
+// run_tasks runs fn over each task using one thread per task. If a thread
+// cannot be created the task is run by the calling thread instead.
+static void run_tasks(void *(*fn)(void *), void *tasks, size_t task_size, size_t n) {
+	pthread_t threads[PARALLEL_SORT_MAX_THREADS];
+	bool started[PARALLEL_SORT_MAX_THREADS];
+	assert(n <= PARALLEL_SORT_MAX_THREADS);
+	for (size_t i = 1; i < n; i++) {
+		void *arg = (char *)tasks + (i * task_size);
+		started[i] = pthread_create(&threads[i], NULL, fn, arg) == 0;
+	}
+	fn(tasks); // use the current thread for the first task
+	for (size_t i = 1; i < n; i++) {
+		if (!started[i]) {
+			fn((char *)tasks + (i * task_size));
+		} else if (pthread_join(threads[i], NULL) != 0) {
+			fprintf(stderr, PROGRAM_NAME": fatal error: pthread_join\n");
+			abort();
+		}
+	}
+}
+
+static long default_sort_threads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+// parallel_sort sorts keys using up to nthreads threads. The result is the
+// same as calling qsort with sort_key_compare.
+static void parallel_sort(sort_key *keys, size_t len, size_t skip, long nthreads) {
+	if (nthreads > PARALLEL_SORT_MAX_THREADS) {
+		nthreads = PARALLEL_SORT_MAX_THREADS;
+	}
+	if (nthreads > 1 && len / PARALLEL_SORT_MIN_KEYS < (size_t)nthreads) {
+		nthreads = len / PARALLEL_SORT_MIN_KEYS;
+	}
+	if (nthreads <= 1) {
+		radix_sort(keys, len, skip);
+		return;
+	}
+
+	// Sort runs
+	const size_t nruns = nthreads;
+	size_t bounds[PARALLEL_SORT_MAX_THREADS + 1];
+	sort_task sorts[PARALLEL_SORT_MAX_THREADS];
+	for (size_t i = 0; i <= nruns; i++) {
+		bounds[i] = (len / nruns) * i + (i < len % nruns ? i : len % nruns);
+	}
+	for (size_t i = 0; i < nruns; i++) {
+		sorts[i] = (sort_task){ &keys[bounds[i]], bounds[i + 1] - bounds[i], skip };
+	}
+	run_tasks(sort_task_run, sorts, sizeof(sort_task), nruns);
+
+	// Merge runs pairwise, alternating between keys and tmp
+	sort_key *tmp = xmalloc(sizeof(sort_key) * len);
+	sort_key *src = keys;
+	sort_key *dst = tmp;
+	merge_task merges[PARALLEL_SORT_MAX_THREADS];
+	for (size_t width = 1; width < nruns; width *= 2) {
+		// Split each pair of runs into parts so that all threads are used
+		const size_t npairs = (nruns + 2 * width - 1) / (2 * width);
+		const size_t parts = (size_t)nthreads / npairs;
+		size_t ntasks = 0;
+		for (size_t r = 0; r < nruns; r += 2 * width) {
+			size_t a = bounds[r];
+			size_t m = bounds[r + width < nruns ? r + width : nruns];
+			size_t b = bounds[r + 2 * width < nruns ? r + 2 * width : nruns];
+			for (size_t p = 0; p < parts; p++) {
+				merges[ntasks++] = (merge_task){
+					.a     = &src[a],
+					.a_len = m - a,
+					.b     = &src[m],
+					.b_len = b - m,
+					.out   = &dst[a],
+					.lo    = (b - a) * p / parts,
+					.hi    = (b - a) * (p + 1) / parts,
+				};
+			}
+		}
+		run_tasks(merge_task_run, merges, sizeof(merge_task), ntasks);
+		sort_key *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != keys) {
+		memcpy(keys, src, sizeof(sort_key) * len);
+	}
+	free(tmp);
+}
+
+// has_prefix returns if s (of length s_len) starts with prefix and is
+// optimized for small prefixes (it seems that clang/gcc will still call
+// strncmp even when the string being compared to and it's length are
+// constant).
+static inline bool has_prefix(const char *s, size_t s_len, const char *prefix) {
+	// computed at compile time if inlined at O3 for gcc and O2+ for clang
+	const size_t n = strlen(prefix);
+	if (s_len < n) {
+		return false;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (s[i] != prefix[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static char *trim_prefix_inplace(char *buf, size_t buf_len, size_t *new_len) {
+	if (buf_len > 2) {
+		if (memcmp(buf, "./", 2) == 0) {
+			*new_len = buf_len - 2;
+			return &buf[2];
+		}
+		if (memcmp(buf, "\x1b[", 2) == 0) {
+			const char *p = memchr(buf, 'm', buf_len);
+			if (p) {
+				size_t i = p - buf + 1;
+				if (has_prefix(&buf[i], buf_len - i, "./\x1b[0m")) {
+					i += strlen("./\x1b[0m");
+					*new_len = buf_len - i;
+					return &buf[i];
+				}
+				if (has_prefix(&buf[i], buf_len - i, "./")) {
+					// Overwrite './' with the ANSI escape code
+					memmove(&buf[2], buf, i);
+					*new_len = buf_len - 2;
+					return &buf[2];
+				}
+			}
+		}
+	}
+	*new_len = buf_len;
+	return buf;
+}
+
+// ANSI scanning
+//
+// ansi_scan returns the index of the first ESC or NUL byte in s, or n if
+// there is none. It is the inner loop of both ANSI detection and stripping
+// so it has SIMD implementations that check 16 (SSE2, NEON) or 32 (AVX2)
+// bytes at a time. The implementation is selected on first use based on
+// the features supported by the CPU.
+
+static size_t ansi_scan_scalar(const char *s, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		if (s[i] == '\x1b' || s[i] == '\0') {
+			return i;
+		}
+	}
+	return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((__target__("sse2")))
+static size_t ansi_scan_sse2(const char *s, size_t n) {
+	const __m128i esc = _mm_set1_epi8('\x1b');
+	const __m128i nul = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)&s[i]);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, esc), _mm_cmpeq_epi8(v, nul));
+		unsigned mask = _mm_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + ansi_scan_scalar(&s[i], n - i);
+}
+
+__attribute__((__target__("avx2")))
+static size_t ansi_scan_avx2(const char *s, size_t n) {
+	const __m256i esc = _mm256_set1_epi8('\x1b');
+	const __m256i nul = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)&s[i]);
+		__m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, esc), _mm256_cmpeq_epi8(v, nul));
+		unsigned mask = _mm256_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + ansi_scan_sse2(&s[i], n - i);
+}
+
+#elif defined(__aarch64__)
+
+static size_t ansi_scan_neon(const char *s, size_t n) {
+	const uint8x16_t esc = vdupq_n_u8('\x1b');
+	const uint8x16_t nul = vdupq_n_u8(0);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)&s[i]);
+		uint8x16_t m = vorrq_u8(vceqq_u8(v, esc), vceqq_u8(v, nul));
+		// Narrow each byte of the mask to 4 bits
+		uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+		if (mask) {
+			return i + (__builtin_ctzll(mask) / 4);
+		}
+	}
+	return i + ansi_scan_scalar(&s[i], n - i);
+}
+
+#endif
+
+static size_t ansi_scan_init(const char *s, size_t n);
+
+static size_t (*ansi_scan)(const char *s, size_t n) = ansi_scan_init;
+
+static size_t ansi_scan_init(const char *s, size_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ansi_scan = ansi_scan_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		ansi_scan = ansi_scan_sse2;
+	} else {
+		ansi_scan = ansi_scan_scalar;
+	}
+#elif defined(__aarch64__)
+	ansi_scan = ansi_scan_neon;
+#else
+	ansi_scan = ansi_scan_scalar;
+#endif
+	return ansi_scan(s, n);
+}
+
+static inline bool contains_ansi_escape_code(const char *str, size_t str_len) {
+	for (size_t i = 0; i < str_len; i++) {
+		i += ansi_scan(&str[i], str_len - i);
+		if (i + 1 < str_len && str[i] == '\x1b' && str[i + 1] == '[') {
+			return true;
+		}
+	}
+	return false;
+}
+
+// strip_ansi writes str with all ANSI escape sequences removed to dst, which
+// must be at least str_len bytes, and returns the number of bytes written.
+// Processing stops at the first NUL byte or invalid escape sequence.
+static size_t strip_ansi(char *dst, const char *str, size_t str_len) {
+	const char *p = str;
+	const char *end = str + str_len;
+	char *d = dst;
+
+	while (p < end) {
+		size_t n = ansi_scan(p, end - p);
+		memcpy(d, p, n);
+		d += n;
+		p += n;
+		if (p == end || *p == '\0') {
+			break;
+		}
+		p++; // ESC
+		if (p < end && *p == '[') {
+			const char *m = p;
+			while (m < end && *m != 'm' && *m != '\0') {
+				m++;
+			}
+			if (m == end || *m != 'm') {
+				break; // bad sequence
+			}
+			p = m + 1;
+		} else {
+			*d++ = '\x1b';
+		}
+	}
+	return d - dst;
+}
+
+// is_upper_c checks if c is upper case in the C locale (aka ASCII)
+// this avoids the whole mess that is isuppper and all of its locale
+// based tables and other related fun.
+static inline bool is_upper_c(const unsigned char c) {
+	return 'A' <= c && c <= 'Z';
+}
+
+// ascii_lower writes the n bytes of src to dst with ASCII upper case chars
+// converted to lower case and returns if src contained any upper case chars.
+// The src and dst buffers may be the same. Like ansi_scan this has SIMD
+// implementations that are selected on first use.
+
+static bool ascii_lower_scalar(char *dst, const char *src, size_t n) {
+	bool upper = false;
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = src[i];
+		if (is_upper_c(c)) {
+			c += 'a' - 'A';
+			upper = true;
+		}
+		dst[i] = c;
+	}
+	return upper;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// NB: adding 0x80 - 'A' maps 'A'..'Z' to the smallest 26 signed chars, which
+// lets a single signed comparison find upper case chars.
+
+__attribute__((__target__("sse2")))
+static bool ascii_lower_sse2(char *dst, const char *src, size_t n) {
+	const __m128i bias = _mm_set1_epi8((char)(0x80 - 'A'));
+	const __m128i limit = _mm_set1_epi8((char)(0x80 + 26));
+	const __m128i bit = _mm_set1_epi8(0x20);
+	__m128i any = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)&src[i]);
+		__m128i upper = _mm_cmplt_epi8(_mm_add_epi8(v, bias), limit);
+		any = _mm_or_si128(any, upper);
+		v = _mm_or_si128(v, _mm_and_si128(upper, bit));
+		_mm_storeu_si128((__m128i *)(void *)&dst[i], v);
+	}
+	bool found = _mm_movemask_epi8(any) != 0;
+	return ascii_lower_scalar(&dst[i], &src[i], n - i) || found;
+}
+
+__attribute__((__target__("avx2")))
+static bool ascii_lower_avx2(char *dst, const char *src, size_t n) {
+	const __m256i bias = _mm256_set1_epi8((char)(0x80 - 'A'));
+	const __m256i limit = _mm256_set1_epi8((char)(0x80 + 26));
+	const __m256i bit = _mm256_set1_epi8(0x20);
+	__m256i any = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)&src[i]);
+		__m256i upper = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, bias));
+		any = _mm256_or_si256(any, upper);
+		v = _mm256_or_si256(v, _mm256_and_si256(upper, bit));
+		_mm256_storeu_si256((__m256i *)(void *)&dst[i], v);
+	}
+	bool found = _mm256_movemask_epi8(any) != 0;
+	return ascii_lower_sse2(&dst[i], &src[i], n - i) || found;
+}
+
+#elif defined(__aarch64__)
+
+static bool ascii_lower_neon(char *dst, const char *src, size_t n) {
+	const uint8x16_t a = vdupq_n_u8('A');
+	const uint8x16_t range = vdupq_n_u8(26);
+	const uint8x16_t bit = vdupq_n_u8(0x20);
+	uint8x16_t any = vdupq_n_u8(0);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)&src[i]);
+		uint8x16_t upper = vcltq_u8(vsubq_u8(v, a), range);
+		any = vorrq_u8(any, upper);
+		vst1q_u8((uint8_t *)&dst[i], vorrq_u8(v, vandq_u8(upper, bit)));
+	}
+	bool found = vmaxvq_u8(any) != 0;
+	return ascii_lower_scalar(&dst[i], &src[i], n - i) || found;
+}
+
+#endif
+
+static bool ascii_lower_init(char *dst, const char *src, size_t n);
+
+static bool (*ascii_lower)(char *dst, const char *src, size_t n) = ascii_lower_init;
+
+static bool ascii_lower_init(char *dst, const char *src, size_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ascii_lower = ascii_lower_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		ascii_lower = ascii_lower_sse2;
+	} else {
+		ascii_lower = ascii_lower_scalar;
+	}
+#elif defined(__aarch64__)
+	ascii_lower = ascii_lower_neon;
+#else
+	ascii_lower = ascii_lower_scalar;
+#endif
+	return ascii_lower(dst, src, n);
+}
+
+// Line order
+//
+// Orders other than byte order are implemented by transforming the
+// comparison string of each line into a key whose byte order (memcmp) is
+// the requested order. The key is built once per line so the sort itself
+// (and the prefix based radix sort) is unchanged.
+//
+// ORDER_NATURAL: each run of digits is replaced by '0' (where the digits
+// would have sorted), the number of significant digits, the significant
+// digits and the number of leading zeros, so that "file2" < "file10" and
+// "file1" < "file01". Counts are encoded with order_key_count so numbers of
+// any length are compared in full and the key of every line is unique
+// (which --unique relies on).
+//
+// ORDER_PATH: '/' is mapped to 0x00 and all smaller bytes are incremented
+// by one so that '/' sorts before every other byte and "a/b" < "a-b". The
+// trailing delimiter is dropped so that a directory sorts before its
+// contents.
+
+typedef enum {
+	ORDER_BYTES   = 0,
+	ORDER_NATURAL = 1 << 0,
+	ORDER_PATH    = 1 << 1,
+} line_order;
+
+static inline bool is_digit_c(const unsigned char c) {
+	return '0' <= c && c <= '9';
+}
+
+// order_key_size returns the maximum size of the key of an n byte string.
+static inline size_t order_key_size(size_t n) {
+	return (4 * n) + 2;
+}
+
+// order_key_count writes n to d in an order preserving, self delimiting
+// encoding: one byte per 255 followed by the remainder.
+static inline size_t order_key_count(unsigned char *d, size_t n) {
+	size_t j = 0;
+	for ( ; n >= 255; n -= 255) {
+		d[j++] = 255;
+	}
+	d[j++] = (unsigned char)n;
+	return j;
+}
+
+// order_key writes the key of the n bytes of src for order to dst, which
+// must have room for order_key_size(n) bytes, and returns its length.
+static size_t order_key(char *dst, const char *src, size_t n, line_order order) {
+	const unsigned char *s = (const unsigned char *)src;
+	unsigned char *d = (unsigned char *)dst;
+	size_t j = 0;
+	for (size_t i = 0; i < n; ) {
+		unsigned char c = s[i];
+		if ((order & ORDER_NATURAL) && is_digit_c(c)) {
+			size_t zeros = i;
+			while (i < n && s[i] == '0') {
+				i++;
+			}
+			zeros = i - zeros;
+			size_t start = i;
+			while (i < n && is_digit_c(s[i])) {
+				i++;
+			}
+			size_t len = i - start;
+			d[j++] = '0';
+			j += order_key_count(&d[j], len);
+			memcpy(&d[j], &s[start], len);
+			j += len;
+			j += order_key_count(&d[j], zeros);
+			continue;
+		}
+		if (order & ORDER_PATH) {
+			c = c == '/' ? 0 : c < '/' ? c + 1 : c;
+		}
+		d[j++] = c;
+		i++;
+	}
+	return j;
+}
+
+// Line table
+//
+// The lines being sorted are collected in a line_table. Input that is a
+// regular file is mmap'd and its lines point directly into the mapping,
+// otherwise lines are read with getdelim and copied into the table's arena.
+// Either way the comparison string is only allocated for lines that
+// contain ANSI escape sequences or (when ignoring case) upper case
+// characters, all other lines share it with the line itself.
+
+typedef struct {
+	void   *addr;
+	size_t len;
+} mapping;
+
+typedef struct {
+	line_buffer *lines;
+	size_t      len;
+	size_t      cap;
+	arena       mem;
+	mapping     *maps;
+	size_t      maps_len;
+	char        *scratch; // buffer used to build comparison strings
+	size_t      scratch_cap;
+	size_t      bytes;    // approximate memory used by the lines
+	size_t      limit;    // stop reading once bytes exceeds limit (0 for no limit)
+	char        *keybuf;  // buffer used to build order keys
+	size_t      keybuf_cap;
+	bool        has_ansi;
+	bool        ignore_case;     // store lower case comparison strings
+	bool        no_strip_prefix;
+	line_order  order;
+	char        delim;
+} line_table;
+
+// line_table_clear removes all lines from the table.
+static void line_table_clear(line_table *t) {
+	for (size_t i = 0; i < t->maps_len; i++) {
+		munmap(t->maps[i].addr, t->maps[i].len);
+	}
+	t->maps_len = 0;
+	arena_free(&t->mem);
+	t->len = 0;
+	t->bytes = 0;
+}
+
+static void line_table_free(line_table *t) {
+	line_table_clear(t);
+	free(t->maps);
+	free(t->scratch);
+	free(t->keybuf);
+	free(t->lines);
+	*t = (line_table){ 0 };
+}
+
+static inline bool line_table_full(const line_table *t) {
+	return t->limit > 0 && t->bytes >= t->limit;
+}
+
+static char *line_table_scratch(line_table *t, size_t n) {
+	if (t->scratch_cap < n) {
+		t->scratch_cap = n > 128 ? n : 128;
+		t->scratch = xrealloc(t->scratch, t->scratch_cap);
+	}
+	return t->scratch;
+}
+
+// line_table_comp returns the comparison string of the line dst, which is
+// either dst itself or a string built in the table's scratch buffer (valid
+// until the next call), and stores its length in comp_len.
+static const char *line_table_comp(line_table *t, const char *dst, size_t dlen,
+                                   size_t *comp_len_out) {
+	const int64_t start = phase_start();
+	if (!t->has_ansi) {
+		t->has_ansi = contains_ansi_escape_code(dst, dlen);
+	}
+	const char *comp = dst;
+	size_t comp_len = dlen;
+	if (t->has_ansi) {
+		char *s = line_table_scratch(t, dlen);
+		size_t n = strip_ansi(s, dst, dlen);
+		if (n != dlen) {
+			comp = s;
+			comp_len = n;
+		}
+	}
+	if (t->ignore_case) {
+		// NB: this does not realloc scratch since it was already sized
+		// for dlen if comp points into it.
+		char *s = line_table_scratch(t, dlen);
+		if (ascii_lower(s, comp, comp_len)) {
+			comp = s;
+		}
+	}
+	if (t->order != ORDER_BYTES) {
+		size_t n = comp_len;
+		if ((t->order & ORDER_PATH) && n > 0 && comp[n - 1] == t->delim) {
+			n--;
+		}
+		if (t->keybuf_cap < order_key_size(n)) {
+			t->keybuf_cap = order_key_size(n) > 128 ? order_key_size(n) : 128;
+			t->keybuf = xrealloc(t->keybuf, t->keybuf_cap);
+		}
+		comp_len = order_key(t->keybuf, comp, n, t->order);
+		comp = t->keybuf;
+	}
+	*comp_len_out = comp_len;
+	phase_end(PHASE_STRIP, start);
+	return comp;
+}
+
+// line_table_add adds the line in buf to the table. If copy is true the line
+// is copied into the table's arena, otherwise buf must outlive the table.
+static void line_table_add(line_table *t, char *buf, size_t buf_len, bool copy) {
+	size_t dlen = buf_len;
+	char *dst = t->no_strip_prefix
+		? buf
+		: trim_prefix_inplace(buf, buf_len, &dlen);
+
+	if (t->len == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 1024;
+		t->lines = xrealloc(t->lines, sizeof(line_buffer) * t->cap);
+	}
+	line_buffer *line = &t->lines[t->len++];
+
+	size_t comp_len;
+	const char *comp = line_table_comp(t, dst, dlen, &comp_len);
+
+	// Use one alloc for both the line and comp buffers
+	size_t size = (copy ? dlen : 0) + (comp != dst ? comp_len : 0);
+
+	// NB: the line and the sort key of a line (and the merge buffer used
+	// by parallel_sort) are included since they will be allocated later.
+	t->bytes += sizeof(line_buffer) + (2 * sizeof(sort_key)) + dlen + size;
+
+	char *p = size > 0 ? arena_alloc(&t->mem, size) : NULL;
+	line->line = dst;
+	line->line_len = dlen;
+	if (copy && dlen > 0) {
+		line->line = memcpy(p, dst, dlen);
+		p += dlen;
+	}
+	line->comp = line->line; // NB: sharing pointers
+	line->comp_len = dlen;
+	if (comp != dst) {
+		line->comp = comp_len > 0 ? memcpy(p, comp, comp_len) : line->line;
+		line->comp_len = comp_len;
+	}
+}
+
+// line_table_map adds the lines of istream to the table by mapping it into
+// memory and returns false if istream is not a regular file or could not be
+// mapped. If the table becomes full istream is positioned after the last
+// line that was added.
+static bool line_table_map(line_table *t, FILE *istream, const unsigned char delim) {
+	struct stat st;
+	int fd = fileno(istream);
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		return false; // NB: files in /proc report a size of zero
+	}
+	off_t offset = ftello(istream);
+	if (offset < 0 || offset > st.st_size) {
+		return false;
+	}
+	if (offset == st.st_size) {
+		return true;
+	}
+	char *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		return false;
+	}
+	t->maps = xrealloc(t->maps, sizeof(mapping) * (t->maps_len + 1));
+	t->maps[t->maps_len++] = (mapping){ addr, st.st_size };
+
+	char *p = &addr[offset];
+	char *end = &addr[st.st_size];
+	while (p < end && !line_table_full(t)) {
+		char *next = memchr(p, delim, end - p);
+		next = next ? next + 1 : end;
+		line_table_add(t, p, next - p, false);
+		p = next;
+	}
+	fseeko(istream, p - addr, SEEK_SET);
+	return true;
+}
+
+// line_table_read adds the lines of istream to the table. It returns 1 if
+// the table became full before the end of istream was reached, 0 at the end
+// of istream and -1 if there was an error.
+static int line_table_read(line_table *t, FILE *istream, const unsigned char delim) {
+	if (line_table_map(t, istream, delim)) {
+		return line_table_full(t) ? 1 : 0;
+	}
+	size_t buf_cap = 128;
+	char *buf = xmalloc(128);
+	ssize_t buf_len;
+	while (!line_table_full(t) && (buf_len = getdelim(&buf, &buf_cap, delim, istream)) != -1) {
+		line_table_add(t, buf, buf_len, true);
+	}
+	free(buf);
+	if (ferror(istream)) {
+		return -1;
+	}
+	return line_table_full(t) ? 1 : 0;
+}
+
+typedef struct {
+	bool       ignore_case;
+	bool       fold_case;   // with ignore_case: fold case when comparing
+	bool       no_strip_prefix;
+	long       nthreads;
+	size_t     buffer_size; // memory budget for lines (0 for no limit)
+	bool       unique;      // only output the first of equal lines
+	size_t     head;        // only output the first head lines (0 for all)
+	bool       incremental; // print lines before the end of the input
+	line_order order;
+} sort_options;
+
+// Output
+//
+// Output is written in batches with writev instead of one fwrite per line,
+// which matters when the reader is on the other end of a pipe (e.g. fzf)
+// since every small write is a syscall and a wakeup. Lines whose memory
+// outlives the batch (the sorted lines in the table) are referenced by the
+// batch directly, all others are copied into the writer's buffer.
+
+// Maximum number of iovecs per writev (IOV_MAX on Linux).
+#define WRITER_IOV_MAX 1024
+
+// Size of the copy buffer and the number of bytes that triggers a flush
+// (the default capacity of a pipe on Linux).
+#define WRITER_BUFFER_SIZE (64 * 1024)
+
+// Number of bytes that triggers a flush when streaming lines from input that
+// may be slow (a pipe): the same as stdio so the first lines reach the
+// reader as soon as they used to.
+#define WRITER_STREAM_FLUSH_SIZE (4 * 1024)
+
+typedef struct {
+	int          fd;
+	int          iovcnt;
+	size_t       bytes; // bytes referenced by iov
+	size_t       flush_size; // flush once bytes reaches flush_size
+	struct iovec *iov;
+	char         *buf;
+	size_t       buf_len;
+} writer;
+
+// writer_init initializes w to write to the file descriptor of ostream,
+// anything already buffered by ostream is flushed first.
+static int writer_init(writer *w, FILE *ostream) {
+	*w = (writer){ .fd = fileno(ostream), .flush_size = WRITER_BUFFER_SIZE };
+	if (fflush(ostream) != 0 || w->fd == -1) {
+		return -1;
+	}
+	w->iov = xmalloc(sizeof(struct iovec) * WRITER_IOV_MAX);
+	w->buf = xmalloc(WRITER_BUFFER_SIZE);
+	return 0;
+}
+
+static void writer_free(writer *w) {
+	free(w->iov);
+	free(w->buf);
+	*w = (writer){ .fd = -1 };
+}
+
+// writer_flush writes all batched lines.
+static int writer_flush(writer *w) {
+	struct iovec *iov = w->iov;
+	int iovcnt = w->iovcnt;
+	while (iovcnt > 0) {
+		ssize_t n = writev(w->fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		// Skip the iovecs that were written and adjust a partial write.
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	w->iovcnt = 0;
+	w->bytes = 0;
+	w->buf_len = 0;
+	return 0;
+}
+
+// writer_add adds the n bytes at p to the batch without copying them, p
+// must remain valid until the writer is flushed.
+static int writer_add(writer *w, const char *p, size_t n) {
+	if (n == 0) {
+		return 0;
+	}
+	struct iovec *last = w->iovcnt > 0 ? &w->iov[w->iovcnt - 1] : NULL;
+	if (last && (const char *)last->iov_base + last->iov_len == p) {
+		last->iov_len += n; // contiguous with the previous line
+	} else {
+		w->iov[w->iovcnt++] = (struct iovec){ (void *)(uintptr_t)p, n };
+	}
+	w->bytes += n;
+	if (w->iovcnt == WRITER_IOV_MAX || w->bytes >= w->flush_size) {
+		return writer_flush(w);
+	}
+	return 0;
+}
+
+// writer_copy adds a copy of the n bytes at p to the batch.
+static int writer_copy(writer *w, const char *p, size_t n) {
+	if (WRITER_BUFFER_SIZE - w->buf_len < n && writer_flush(w) != 0) {
+		return -1;
+	}
+	if (n > WRITER_BUFFER_SIZE) {
+		return writer_add(w, p, n); // flushed before returning
+	}
+	char *dst = &w->buf[w->buf_len];
+	memcpy(dst, p, n);
+	w->buf_len += n;
+	return writer_add(w, dst, n);
+}
+
+// External sort
+//
+// When a memory budget is given (--buffer-size) and the input exceeds it,
+// the lines read so far are sorted and written to a temporary file (a run)
+// each time the budget is reached. The runs are then merged through a heap
+// that only holds the current line of each run in memory. Runs are created
+// in input order and ties are broken by run order, so the output is the
+// same as if everything had been sorted in memory.
+
+// Runs are merged in tiers to bound the number of open files: whenever the
+// last RUN_MERGE_WIDTH runs are all of the same level they are merged into
+// one run of the next level (like carrying in a base RUN_MERGE_WIDTH
+// counter), so each line is rewritten once per level.
+#define RUN_MERGE_WIDTH 16
+
+// Size of the stdio buffer used for each run.
+#define RUN_BUFFER_SIZE (64 * 1024)
+
+// Each line is stored in a run as a run_header followed by the line and,
+// unless comp_len is RUN_COMP_IS_LINE, its comparison string.
+#define RUN_COMP_IS_LINE SIZE_MAX
+
+typedef struct {
+	size_t line_len;
+	size_t comp_len;
+} run_header;
+
+typedef struct {
+	FILE     *file;
+	unsigned level;
+} run;
+
+typedef struct {
+	run    *runs;
+	size_t len;
+	size_t cap;
+} run_list;
+
+typedef struct {
+	FILE           *file; // NULL if reading from keys
+	const sort_key *keys;
+	size_t         keys_len;
+	line_buffer    line;  // current line
+	char           *buf;
+	size_t         cap;
+	size_t         order; // position of the run in the input
+} run_cursor;
+
+// run_create returns a new temporary file that is deleted once closed.
+static FILE *run_create(void) {
+	const char *dir = getenv("TMPDIR");
+	if (!dir || !*dir) {
+		dir = "/tmp";
+	}
+	const size_t size = strlen(dir) + sizeof("/"PROGRAM_NAME".XXXXXX");
+	char *name = xmalloc(size);
+	snprintf(name, size, "%s/"PROGRAM_NAME".XXXXXX", dir);
+
+	FILE *f = NULL;
+	int fd = mkstemp(name);
+	if (fd != -1) {
+		unlink(name);
+		if (!(f = fdopen(fd, "w+"))) {
+			close(fd);
+		}
+	}
+	free(name);
+	if (f) {
+		setvbuf(f, NULL, _IOFBF, RUN_BUFFER_SIZE);
+	}
+	return f;
+}
+
+static int run_write_line(FILE *f, const line_buffer *b) {
+	const bool shared = b->comp == b->line && b->comp_len == b->line_len;
+	const run_header h = { b->line_len, shared ? RUN_COMP_IS_LINE : b->comp_len };
+	if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+	    fwrite(b->line, 1, b->line_len, f) != b->line_len) {
+		return -1;
+	}
+	if (!shared && fwrite(b->comp, 1, b->comp_len, f) != b->comp_len) {
+		return -1;
+	}
+	return 0;
+}
+
+// run_cursor_next advances c to the next line of its run and returns 1 on
+// success, 0 at the end of the run and -1 if there was an error.
+static int run_cursor_next(run_cursor *c) {
+	if (!c->file) {
+		if (c->keys_len == 0) {
+			return 0;
+		}
+		c->line = *c->keys->line;
+		c->keys++;
+		c->keys_len--;
+		return 1;
+	}
+
+	run_header h;
+	if (fread(&h, sizeof(h), 1, c->file) != 1) {
+		return ferror(c->file) ? -1 : 0;
+	}
+	const bool shared = h.comp_len == RUN_COMP_IS_LINE;
+	const size_t n = h.line_len + (shared ? 0 : h.comp_len);
+	if (c->cap < n) {
+		c->cap = n;
+		c->buf = xrealloc(c->buf, n);
+	}
+	if (fread(c->buf, 1, n, c->file) != n) {
+		if (!ferror(c->file)) {
+			errno = EIO; // truncated run
+		}
+		return -1;
+	}
+	c->line = (line_buffer){
+		.line     = c->buf,
+		.line_len = h.line_len,
+		.comp     = shared ? c->buf : &c->buf[h.line_len],
+		.comp_len = shared ? h.line_len : h.comp_len,
+	};
+	return 1;
+}
+
+static inline bool run_cursor_less(const run_cursor *c1, const run_cursor *c2) {
+	int ret = line_buffer_compare(&c1->line, &c2->line);
+	return ret != 0 ? ret < 0 : c1->order < c2->order;
+}
+
+static void run_heap_down(run_cursor **heap, size_t len, size_t i) {
+	for (;;) {
+		size_t min = i;
+		size_t l = (2 * i) + 1;
+		size_t r = l + 1;
+		if (l < len && run_cursor_less(heap[l], heap[min])) {
+			min = l;
+		}
+		if (r < len && run_cursor_less(heap[r], heap[min])) {
+			min = r;
+		}
+		if (min == i) {
+			return;
+		}
+		run_cursor *tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+// runs_merge merges the lines of runs and keys, which follow all of the
+// runs in input order. The lines are written to run_out in the run format
+// or, if run_out is NULL, to out as is. The unique and head options of opts
+// apply to the merged lines.
+static int runs_merge(const run *runs, size_t nruns, const sort_key *keys, size_t nkeys,
+                      FILE *run_out, writer *out, const sort_options *opts) {
+	const size_t n = nruns + 1;
+	run_cursor *cursors = xmalloc(sizeof(run_cursor) * n);
+	run_cursor **heap = xmalloc(sizeof(run_cursor *) * n);
+	size_t heap_len = 0;
+	int ret = -1;
+
+	// Copy of the comparison string of the last line written (the cursor
+	// that it came from may have already overwritten it).
+	line_buffer last = { 0 };
+	size_t last_cap = 0;
+	bool have_last = false;
+	const bool unique = opts->unique;
+	size_t nout = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		cursors[i] = (run_cursor){
+			.file     = i < nruns ? runs[i].file : NULL,
+			.keys     = keys,
+			.keys_len = i < nruns ? 0 : nkeys,
+			.order    = i,
+		};
+	}
+	for (size_t i = 0; i < n; i++) {
+		int r = run_cursor_next(&cursors[i]);
+		if (r < 0) {
+			goto exit;
+		}
+		if (r > 0) {
+			heap[heap_len++] = &cursors[i];
+		}
+	}
+	for (size_t i = heap_len / 2; i-- > 0; ) {
+		run_heap_down(heap, heap_len, i);
+	}
+	while (heap_len > 0 && (opts->head == 0 || nout < opts->head)) {
+		run_cursor *c = heap[0];
+		// NB: have_last is only set if unique is true
+		if (!have_last || line_buffer_compare(&last, &c->line) != 0) {
+			if (unique) {
+				if (!last.comp || last_cap < c->line.comp_len) {
+					last_cap = c->line.comp_len > 64 ? c->line.comp_len : 64;
+					last.comp = xrealloc(last.comp, last_cap);
+				}
+				if (c->line.comp_len > 0) {
+					memcpy(last.comp, c->line.comp, c->line.comp_len);
+				}
+				last.comp_len = c->line.comp_len;
+				have_last = true;
+			}
+			if (run_out) {
+				if (run_write_line(run_out, &c->line) != 0) {
+					goto exit;
+				}
+			} else if (writer_copy(out, c->line.line, c->line.line_len) != 0) {
+				goto exit;
+			}
+			nout++;
+		}
+		int r = run_cursor_next(c);
+		if (r < 0) {
+			goto exit;
+		}
+		if (r == 0) {
+			heap[0] = heap[--heap_len];
+		}
+		run_heap_down(heap, heap_len, 0);
+	}
+	ret = 0;
+
+exit:
+	for (size_t i = 0; i < n; i++) {
+		free(cursors[i].buf);
+	}
+	free(last.comp);
+	free(cursors);
+	free(heap);
+	return ret;
+}
 
-#define _line_buffer_for_each(lbuf, len, value, __p, __e)               \
-	line_buffer *(__e) = &(lbuf)[(len)];                                \
-	for ((value) = (lbuf); (value) < (__e); (value)++)
+static void run_list_free(run_list *runs) {
+	for (size_t i = 0; i < runs->len; i++) {
+		fclose(runs->runs[i].file);
+	}
+	free(runs->runs);
+	*runs = (run_list){ 0 };
+}
 
-#define line_buffer_for_each(lbuf, len, value)                          \
-		_line_buffer_for_each(lbuf, len, value, UNIQUE_ALIAS(__p), UNIQUE_ALIAS(__e))
+// run_list_compact merges the last RUN_MERGE_WIDTH runs while they are of
+// the same level.
+static int run_list_compact(run_list *runs, const sort_options *opts) {
+	while (runs->len >= RUN_MERGE_WIDTH) {
+		run *last = &runs->runs[runs->len - RUN_MERGE_WIDTH];
+		const unsigned level = last[RUN_MERGE_WIDTH - 1].level;
+		if (last[0].level != level) {
+			return 0;
+		}
+		FILE *f = run_create();
+		if (!f) {
+			return -1;
+		}
+		if (runs_merge(last, RUN_MERGE_WIDTH, NULL, 0, f, NULL, opts) != 0 ||
+		    fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0) {
+			fclose(f);
+			return -1;
+		}
+		for (size_t i = 0; i < RUN_MERGE_WIDTH; i++) {
+			fclose(last[i].file);
+		}
+		runs->len -= RUN_MERGE_WIDTH - 1;
+		*last = (run){ f, level + 1 };
+	}
+	return 0;
+}
 
-static void line_buffer_free(line_buffer *b) {
-	if (b && b->line) {
-		free(b->line);
+// run_list_spill sorts the lines of t, writes them to a new run and clears t.
+static int run_list_spill(run_list *runs, line_table *t, const sort_options *opts) {
+	FILE *f = run_create();
+	if (!f) {
+		return -1;
+	}
+	size_t skip;
+	sort_key *keys = make_sort_keys(t->lines, t->len, &skip);
+	parallel_sort(keys, t->len, skip, opts->nthreads);
+	int ret = 0;
+	size_t nout = 0;
+	for (size_t i = 0; i < t->len && ret == 0; i++) {
+		if (opts->head > 0 && nout == opts->head) {
+			break;
+		}
+		if (opts->unique && i > 0 && sort_key_equal(&keys[i - 1], &keys[i])) {
+			continue;
+		}
+		ret = run_write_line(f, keys[i].line);
+		nout++;
 	}
-#ifndef NDEBUG
-	if (b) {
-		*b = (line_buffer){ 0 };
+	free(keys);
+	if (ret != 0 || fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return -1;
 	}
-#endif
+	if (runs->len == runs->cap) {
+		runs->cap = runs->cap ? runs->cap * 2 : RUN_MERGE_WIDTH;
+		runs->runs = xrealloc(runs->runs, sizeof(run) * runs->cap);
+	}
+	runs->runs[runs->len++] = (run){ f, 0 };
+	line_table_clear(t);
+	return run_list_compact(runs, opts);
 }
 
-// CEV: We can't just return `_l1 - _l2` here since we're casting to an int
-// and in the unlikely event that we have multi GB lines it will overflow.
-#define CMP_LEN(_l1, _l2) (_l1) == (_l2) ? 0 : (_l1) > (_l2) ? 1 : -1
+// Top lines
+//
+// With --head N (and without --unique) only the N smallest lines are kept
+// while reading, in a max-heap ordered by comparison string and then input
+// order. Each line is compared with the largest line in the heap and is
+// dropped unless it is smaller, so most lines of a large input are never
+// copied and memory use is bounded by N instead of the input size.
 
-static inline int line_buffer_compare_strings(const void* p1, const void* p2) {
-	// TODO: handle non-ASCII characters
-	const line_buffer *b1 = (const line_buffer*)p1;
-	const line_buffer *b2 = (const line_buffer*)p2;
-	int ret = memcmp(b1->comp, b2->comp, b1->comp_len < b2->comp_len
-		? b1->comp_len : b2->comp_len);
-	return ret != 0 ? ret : CMP_LEN(b1->comp_len, b2->comp_len);
+typedef struct {
+	line_buffer line;  // line and comp point into buf
+	char        *buf;
+	size_t      cap;
+	size_t      order; // position in the input
+} head_entry;
+
+static inline bool head_entry_less(const head_entry *e1, const head_entry *e2) {
+	int ret = line_buffer_compare(&e1->line, &e2->line);
+	return ret != 0 ? ret < 0 : e1->order < e2->order;
 }
 
-// has_prefix returns if s starts with prefix and is optimized for small
-// prefixes (it seems that clang/gcc will still call strncmp even when the
-// string being compared to and it's length are constant).
-static inline bool has_prefix(const char *s, const char *prefix) {
-	// computed at compile time if inlined at O3 for gcc and O2+ for clang
-	const int n = strlen(prefix);
-	for (int i = 0; i < n; i++) {
-		if (s[i] != prefix[i]) {
-			return false;
+static void head_heap_up(head_entry *heap, size_t i) {
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!head_entry_less(&heap[parent], &heap[i])) {
+			return;
 		}
+		head_entry tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
 	}
-	return true;
 }
 
-static char *trim_prefix_inplace(char *buf, size_t buf_len, size_t *new_len) {
-	if (buf_len > 2) {
-		if (memcmp(buf, "./", 2) == 0) {
-			*new_len = buf_len - 2;
-			return &buf[2];
+static void head_heap_down(head_entry *heap, size_t len, size_t i) {
+	for (;;) {
+		size_t max = i;
+		size_t l = (2 * i) + 1;
+		size_t r = l + 1;
+		if (l < len && head_entry_less(&heap[max], &heap[l])) {
+			max = l;
 		}
-		if (memcmp(buf, "\x1b[", 2) == 0) {
-			const char *p = memchr(buf, 'm', buf_len);
-			if (p) {
-				ssize_t i = p - buf + 1;
-				if (has_prefix(&buf[i], "./\x1b[0m")) {
-					i += strlen("./\x1b[0m");
-					*new_len = buf_len - i;
-					return &buf[i];
-				}
-				if (has_prefix(&buf[i], "./")) {
-					// Overwrite './' with the ANSI escape code
-					memmove(&buf[2], buf, i);
-					*new_len = buf_len - 2;
-					return &buf[2];
-				}
-			}
+		if (r < len && head_entry_less(&heap[max], &heap[r])) {
+			max = r;
+		}
+		if (max == i) {
+			return;
 		}
+		head_entry tmp = heap[i];
+		heap[i] = heap[max];
+		heap[max] = tmp;
+		i = max;
 	}
-	*new_len = buf_len;
-	return buf;
 }
 
-static inline bool contains_ansi_escape_code(const char *str, size_t str_len) {
-	const size_t esc_len = strlen("\x1b[");
+// head_entry_set copies line (of length line_len) and its comparison string
+// into e.
+static void head_entry_set(head_entry *e, const char *line, size_t line_len,
+                           const char *comp, size_t comp_len, size_t order) {
+	const bool shared = comp == line;
+	const size_t n = line_len + (shared ? 0 : comp_len);
+	if (!e->buf || e->cap < n) {
+		e->cap = n > 64 ? n : 64;
+		free(e->buf);
+		e->buf = xmalloc(e->cap);
+	}
+	memcpy(e->buf, line, line_len);
+	if (!shared) {
+		memcpy(&e->buf[line_len], comp, comp_len);
+	}
+	e->line = (line_buffer){
+		.line     = e->buf,
+		.line_len = line_len,
+		.comp     = shared ? e->buf : &e->buf[line_len],
+		.comp_len = comp_len,
+	};
+	e->order = order;
+}
 
-	return str_len >= esc_len && (
-		memcmp(str, "\x1b[", esc_len) == 0 || memmem(str, str_len, "\x1b[", esc_len) != NULL
-	);
+static int head_entry_compare(const void *p1, const void *p2) {
+	const head_entry *e1 = (const head_entry *)p1;
+	const head_entry *e2 = (const head_entry *)p2;
+	return head_entry_less(e1, e2) ? -1 : head_entry_less(e2, e1) ? 1 : 0;
 }
 
-static void strip_ansi(char **dst, size_t *dst_len, const char *str, size_t str_len) {
-	unsigned const char *p = (unsigned const char *)str;
-	unsigned char c;
-	size_t n = 0;
+static int consume_stream_head(FILE **istreams, size_t nstreams, FILE *ostream,
+                               const unsigned char delim, const sort_options *opts) {
+	line_table t = {
+		.ignore_case     = opts->ignore_case && !opts->fold_case,
+		.no_strip_prefix = opts->no_strip_prefix,
+		.order           = opts->order,
+		.delim           = (char)delim,
+	};
+	const size_t k = opts->head;
+	head_entry *heap = NULL;
+	size_t heap_len = 0;
+	size_t heap_cap = 0;
+	size_t order = 0;
+	size_t buf_cap = 128;
+	char *buf = xmalloc(buf_cap);
+	writer out = { .fd = -1 };
+	sort_fold_case = opts->ignore_case && opts->fold_case;
 
-	// Count the number of non-ANSI bytes
-	while ((c = *p++)) {
-		if (c == '\x1b' && *p == '[') {
-			while ((c = *p++)) {
-				if (c == 'm') {
-					break;
+	for (size_t i = 0; i < nstreams; i++) {
+		FILE *istream = istreams[i];
+		ssize_t buf_len;
+		while ((buf_len = getdelim(&buf, &buf_cap, delim, istream)) != -1) {
+			size_t dlen = buf_len;
+			char *dst = opts->no_strip_prefix
+				? buf
+				: trim_prefix_inplace(buf, buf_len, &dlen);
+			size_t comp_len;
+			const char *comp = line_table_comp(&t, dst, dlen, &comp_len);
+			if (heap_len < k) {
+				if (heap_len == heap_cap) {
+					heap_cap = heap_cap ? heap_cap * 2 : 64;
+					heap_cap = heap_cap < k ? heap_cap : k;
+					heap = xrealloc(heap, sizeof(head_entry) * heap_cap);
 				}
+				head_entry *e = &heap[heap_len];
+				*e = (head_entry){ 0 };
+				head_entry_set(e, dst, dlen, comp, comp_len, order++);
+				head_heap_up(heap, heap_len++);
+				continue;
 			}
-			if (!c) {
-				break; // bad sequence
+			// Later lines lose ties so an equal line is never added
+			const line_buffer line = {
+				.line = dst, .line_len = dlen,
+				.comp = (char *)(uintptr_t)comp, .comp_len = comp_len,
+			};
+			if (line_buffer_compare(&line, &heap[0].line) < 0) {
+				head_entry_set(&heap[0], dst, dlen, comp, comp_len, order);
+				head_heap_down(heap, heap_len, 0);
 			}
-		} else {
-			n++;
+			order++;
+		}
+		if (ferror(istream)) {
+			goto fatal_error;
 		}
 	}
 
-	// All ANSI
-	if (n == 0) {
-		// WARN: all ANSI
-		*dst_len = 0;
-		*dst[0] = '\0';
-		return;
+	qsort(heap, heap_len, sizeof(head_entry), head_entry_compare);
+	if (writer_init(&out, ostream) != 0) {
+		goto fatal_error;
+	}
+	for (size_t i = 0; i < heap_len; i++) {
+		if (writer_add(&out, heap[i].line.line, heap[i].line.line_len) != 0) {
+			goto fatal_error;
+		}
+	}
+	if (writer_flush(&out) != 0) {
+		goto fatal_error;
 	}
 
-	// No ANSI
-	if (n == str_len) {
-		*dst = xrealloc(*dst, str_len + 1);
-		memcpy(*dst, str, str_len + 1);
-		*dst_len = str_len;
-		return;
+	fflush(stdout);
+	writer_free(&out);
+	for (size_t i = 0; i < heap_len; i++) {
+		free(heap[i].buf);
 	}
+	free(heap);
+	free(buf);
+	line_table_free(&t);
+	return 0;
 
-	*dst_len = n;
-	*dst = xrealloc(*dst, n + 1);
-	unsigned char *d = *(unsigned char **)dst;
+fatal_error:
+	fprintf(stderr, PROGRAM_NAME": fatal error: %s\n", strerror(errno));
+	return 1;
+}
 
-	p = (unsigned const char *)str; // reset
-	while ((c = *p++)) {
-		if (c == '\x1b' && *p == '[') {
-			while ((c = *p++)) {
-				if (c == 'm') {
-					break;
-				}
-			}
-			if (!c) {
-				break; // bad sequence
+// Incremental sort
+//
+// With --incremental lines are printed while the input is still being read
+// so that an interactive reader (e.g. fzf) does not have to wait for the end
+// of the input. When no input is available (and at least
+// INCREMENTAL_INTERVAL_MS have passed since the last flush) the lines read
+// since the last flush are sorted and those that sort after the last line
+// printed are printed. The remaining (late) lines are held back and printed,
+// sorted along with any lines still pending, at the end of the input. So the
+// output is at most two sorted runs: lines printed while reading and late
+// lines. Input that never stalls is sorted in full and regular files, which
+// never need to be waited for, are always read in full before anything is
+// printed.
+
+#define INCREMENTAL_INTERVAL_MS 100
+
+#define INCREMENTAL_READ_SIZE (64 * 1024)
+
+typedef struct {
+	line_table t;
+	writer     out;
+	size_t     next;     // index of the first line that was not flushed
+	size_t     *held;    // indexes of late lines
+	size_t     held_len;
+	size_t     held_cap;
+	size_t     last;     // index of the last line printed
+	bool       printed;  // if any line was printed
+	long       nthreads;
+} incremental_sort;
+
+static int64_t monotonic_millis(void) {
+	return monotonic_nanos() / 1000000;
+}
+
+// incremental_flush sorts the lines read since the last flush and prints
+// those that do not sort before the last line printed.
+static int incremental_flush(incremental_sort *inc) {
+	line_table *t = &inc->t;
+	const size_t len = t->len - inc->next;
+	if (len == 0) {
+		return 0;
+	}
+	size_t skip;
+	sort_key *keys = make_sort_keys(&t->lines[inc->next], len, &skip);
+	parallel_sort(keys, len, skip, inc->nthreads);
+
+	size_t i = 0;
+	if (inc->printed) {
+		const line_buffer *last = &t->lines[inc->last];
+		for (; i < len && line_buffer_compare(keys[i].line, last) < 0; i++) {
+			if (inc->held_len == inc->held_cap) {
+				inc->held_cap = inc->held_cap ? inc->held_cap * 2 : 1024;
+				inc->held = xrealloc(inc->held, sizeof(size_t) * inc->held_cap);
 			}
-		} else {
-			*d++ = c;
+			inc->held[inc->held_len++] = (size_t)(keys[i].line - t->lines);
 		}
 	}
-	*d = '\0';
+	int ret = 0;
+	for (; i < len && ret == 0; i++) {
+		ret = writer_add(&inc->out, keys[i].line->line, keys[i].line->line_len);
+		inc->last = (size_t)(keys[i].line - t->lines);
+		inc->printed = true;
+	}
+	free(keys);
+	inc->next = t->len;
+	return ret == 0 ? writer_flush(&inc->out) : -1;
 }
 
-// is_upper_c checks if c is upper case in the C locale (aka ASCII)
-// this avoids the whole mess that is isuppper and all of its locale
-// based tables and other related fun.
-static inline bool is_upper_c(const unsigned char c) {
-	return 'A' <= c && c <= 'Z';
-}
+// incremental_finish prints the late lines and any lines that were not
+// flushed.
+static int incremental_finish(incremental_sort *inc) {
+	line_table *t = &inc->t;
+	// NB: held lines precede the pending lines in the input so copying them
+	// in this order retains the input order of equal lines.
+	const size_t len = inc->held_len + (t->len - inc->next);
+	line_buffer *lines = xmalloc(sizeof(line_buffer) * len);
+	for (size_t i = 0; i < inc->held_len; i++) {
+		lines[i] = t->lines[inc->held[i]];
+	}
+	memcpy(&lines[inc->held_len], &t->lines[inc->next],
+		sizeof(line_buffer) * (t->len - inc->next));
 
-static bool has_upper_case_chars(char *s, size_t n) {
-	const unsigned char *end = (const unsigned char *)(&s[n]);
-	unsigned char *p = (unsigned char *)s;
-	while (p < end) {
-		if (is_upper_c(*p++)) {
-			return true;
-		}
+	size_t skip;
+	sort_key *keys = make_sort_keys(lines, len, &skip);
+	parallel_sort(keys, len, skip, inc->nthreads);
+	int ret = 0;
+	for (size_t i = 0; i < len && ret == 0; i++) {
+		ret = writer_add(&inc->out, keys[i].line->line, keys[i].line->line_len);
 	}
-	return false;
+	if (ret == 0) {
+		ret = writer_flush(&inc->out);
+	}
+	free(keys);
+	free(lines);
+	inc->held_len = 0;
+	inc->next = t->len;
+	return ret;
 }
 
-static void str_to_lower(char *s, size_t n) {
-	const unsigned char *end = (const unsigned char *)(&s[n]);
-	unsigned char *p = (unsigned char *)s;
-	while (p < end) {
-		if (is_upper_c(*p)) {
-			*p += 'a' - 'A';
+static int consume_stream_incremental(FILE **istreams, size_t nstreams, FILE *ostream,
+                                      const unsigned char delim,
+                                      const sort_options *opts) {
+	incremental_sort inc = {
+		.t = {
+			.ignore_case     = opts->ignore_case && !opts->fold_case,
+			.no_strip_prefix = opts->no_strip_prefix,
+			.order           = opts->order,
+			.delim           = (char)delim,
+		},
+		.nthreads = opts->nthreads,
+	};
+	size_t buf_cap = INCREMENTAL_READ_SIZE;
+	size_t buf_len = 0;
+	char *buf = xmalloc(buf_cap);
+	sort_fold_case = opts->ignore_case && opts->fold_case;
+
+	if (writer_init(&inc.out, ostream) != 0) {
+		goto fatal_error;
+	}
+	int64_t deadline = monotonic_millis() + INCREMENTAL_INTERVAL_MS;
+	for (size_t i = 0; i < nstreams; i++) {
+		// NB: input is read directly from the file descriptor so that we
+		// can wait for it with poll, nothing has been buffered by stdio.
+		const int fd = fileno(istreams[i]);
+		struct stat st;
+		const bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+		for (;;) {
+			// Flush if no input arrives before the next flush is due
+			if (!regular && inc.next < inc.t.len) {
+				int64_t now = monotonic_millis();
+				int timeout = now < deadline ? (int)(deadline - now) : 0;
+				struct pollfd pfd = { .fd = fd, .events = POLLIN };
+				if (poll(&pfd, 1, timeout) == 0) {
+					if (incremental_flush(&inc) != 0) {
+						goto fatal_error;
+					}
+					deadline = monotonic_millis() + INCREMENTAL_INTERVAL_MS;
+				}
+			}
+			if (buf_cap - buf_len < INCREMENTAL_READ_SIZE) {
+				buf_cap *= 2;
+				buf = xrealloc(buf, buf_cap);
+			}
+			ssize_t n = read(fd, &buf[buf_len], buf_cap - buf_len);
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN) {
+					continue;
+				}
+				goto fatal_error;
+			}
+			if (n == 0) {
+				break;
+			}
+			// Add the complete lines and move the rest to the front
+			char *p = buf;
+			char *end = &buf[buf_len + (size_t)n];
+			char *q;
+			while ((q = memchr(p, delim, (size_t)(end - p))) != NULL) {
+				line_table_add(&inc.t, p, (size_t)(q - p) + 1, true);
+				p = q + 1;
+			}
+			buf_len = (size_t)(end - p);
+			memmove(buf, p, buf_len);
+		}
+		if (buf_len > 0) {
+			line_table_add(&inc.t, buf, buf_len, true);
+			buf_len = 0;
 		}
-		p++;
 	}
-}
+	if (incremental_finish(&inc) != 0) {
+		goto fatal_error;
+	}
 
-static int consume_stream_sort(FILE *istream, FILE *ostream, const unsigned char delim,
-                               bool ignore_case, bool no_strip_prefix) {
-	size_t buf_cap = 128;
-	size_t line_cap = 8;
-	char *buf = xmalloc(128);
-	char *comp = xmalloc(128);
-	line_buffer *lines = xmalloc(sizeof(line_buffer) * line_cap);
-	size_t li = 0;
+	fflush(stdout);
+	free(buf);
+	free(inc.held);
+	writer_free(&inc.out);
+	line_table_free(&inc.t);
+	return 0;
 
-	bool has_ansi = false;
-	ssize_t buf_len;
-	while ((buf_len = getdelim(&buf, &buf_cap, delim, istream)) != -1) {
-		size_t dlen = buf_len;
-		char *dst = no_strip_prefix
-			? buf
-			: trim_prefix_inplace(buf, buf_len, &dlen);
-		if (!has_ansi) {
-			has_ansi = contains_ansi_escape_code(dst, dlen);
-		}
+fatal_error:
+	fprintf(stderr, PROGRAM_NAME": fatal error: %s\n", strerror(errno));
+	return 1;
+}
 
-		if (li == line_cap) {
-			line_cap *= 2;
-			lines = xrealloc(lines, sizeof(line_buffer) * line_cap);
-		}
-		lines[li] = (line_buffer){ 0 }; // zero
-		line_buffer *line = &lines[li++];
+static int consume_stream_sort(FILE **istreams, size_t nstreams, FILE *ostream,
+                               const unsigned char delim, const sort_options *opts) {
+	if (opts->incremental) {
+		return consume_stream_incremental(istreams, nstreams, ostream, delim, opts);
+	}
+	if (opts->head > 0 && !opts->unique) {
+		return consume_stream_head(istreams, nstreams, ostream, delim, opts);
+	}
+	line_table t = {
+		.ignore_case     = opts->ignore_case && !opts->fold_case,
+		.no_strip_prefix = opts->no_strip_prefix,
+		.order           = opts->order,
+		.delim           = (char)delim,
+		.limit           = opts->buffer_size,
+	};
+	run_list runs = { 0 };
+	sort_key *keys = NULL;
+	writer out = { .fd = -1 };
+	sort_fold_case = opts->ignore_case && opts->fold_case;
 
-		if (has_ansi) {
-			size_t comp_len;
-			strip_ansi(&comp, &comp_len, dst, dlen);
-			if (ignore_case) {
-				str_to_lower(comp, comp_len);
-			}
-			// Use one alloc for both the line and comp buffers
-			line->line = xmalloc(dlen + comp_len + 2);
-			line->line_len = dlen;
-			line->comp = &line->line[dlen + 1];
-			line->comp_len = comp_len;
-			memcpy(line->line, dst, dlen + 1);
-			memcpy(line->comp, comp, comp_len + 1);
-		} else {
-			if (ignore_case && has_upper_case_chars(dst, dlen)) {
-				line->line = xmalloc((dlen * 2) + 2);
-				line->line_len = dlen;
-				line->comp_len = dlen;
-				line->comp = &line->line[dlen + 1];
-				memcpy(line->line, dst, dlen + 1);
-				memcpy(line->comp, dst, dlen + 1);
-				str_to_lower(line->comp, dlen);
-			} else {
-				line->line = xmalloc(dlen + 1);
-				memcpy(line->line, dst, dlen + 1);
-				line->line_len = dlen;
-				line->comp = line->line; // NB: sharing pointers
-				line->comp_len = dlen;
+	// NB: spilling runs is included in the read phase.
+	int64_t start = phase_start();
+	for (size_t i = 0; i < nstreams; i++) {
+		int ret;
+		while ((ret = line_table_read(&t, istreams[i], delim)) == 1) {
+			if (run_list_spill(&runs, &t, opts) != 0) {
+				goto fatal_error;
 			}
 		}
+		if (ret != 0) {
+			goto fatal_error;
+		}
 	}
-	if (ferror(stdin)) {
-		goto fatal_error;
-	}
-	if (li == 0) {
+	phase_end(PHASE_READ, start);
+	if (t.len == 0 && runs.len == 0) {
 		goto exit_cleanup;
 	}
 
 	// NB: I tried using an inlined version of glibc's qsort but this is faster.
-	qsort(lines, li, sizeof(line_buffer), line_buffer_compare_strings);
+	start = phase_start();
+	size_t skip;
+	keys = make_sort_keys(t.lines, t.len, &skip);
+	parallel_sort(keys, t.len, skip, opts->nthreads);
+	phase_end(PHASE_SORT, start);
 
-	line_buffer *p;
-	line_buffer_for_each(lines, li, p) {
-		size_t ret = fwrite(p->line, 1, p->line_len, ostream);
-		if (ret < p->line_len) {
+	start = phase_start();
+	if (writer_init(&out, ostream) != 0) {
+		goto fatal_error;
+	}
+	if (runs.len > 0) {
+		if (runs_merge(runs.runs, runs.len, keys, t.len, NULL, &out, opts) != 0) {
 			goto fatal_error;
 		}
+	} else {
+		size_t nout = 0;
+		for (size_t i = 0; i < t.len; i++) {
+			if (opts->head > 0 && nout == opts->head) {
+				break;
+			}
+			if (opts->unique && i > 0 && sort_key_equal(&keys[i - 1], &keys[i])) {
+				continue;
+			}
+			const line_buffer *p = keys[i].line;
+			if (writer_add(&out, p->line, p->line_len) != 0) {
+				goto fatal_error;
+			}
+			nout++;
+		}
+	}
+	if (writer_flush(&out) != 0) {
+		goto fatal_error;
 	}
+	phase_end(PHASE_WRITE, start);
 
 exit_cleanup:
 
 	fflush(stdout);
-	free(buf);
-	free(comp);
-	// TODO: measure how long it takes to free lines
-	if (li > 0) {
-		line_buffer_for_each(lines, li, p) {
-			line_buffer_free(p);
-		}
-	}
-	free(lines);
+	start = phase_start();
+	writer_free(&out);
+	free(keys);
+	run_list_free(&runs);
+	line_table_free(&t);
+	phase_end(PHASE_FREE, start);
 	return 0;
 
 fatal_error:
@@ -320,29 +2054,177 @@ fatal_error:
 	return 1;
 }
 
-static int consume_stream(FILE *istream, FILE *ostream, const unsigned char delim,
-                          bool no_strip_prefix) {
+// Unique lines
+//
+// When the input is not sorted duplicate lines are not adjacent, so the
+// comparison strings of the lines that were written are kept in a hash set
+// (open addressing with linear probing). The strings are copied into an
+// arena and each slot stores the full hash so that probing rarely needs to
+// compare strings.
+
+// The set is grown when more than 3/4 of its slots are used.
+#define UNIQUE_SET_MIN_CAP 1024
+
+typedef struct {
+	uint64_t   hash;
+	const char *str;  // NULL if the slot is empty
+	size_t     len;
+} unique_entry;
+
+typedef struct {
+	unique_entry *slots;
+	size_t       len;
+	size_t       cap; // power of 2
+	arena        mem;
+} unique_set;
+
+// hash_bytes returns a 64-bit hash of s that is computed 8 bytes at a time.
+static uint64_t hash_bytes(const char *s, size_t n) {
+	const uint64_t m = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = n * m;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t v;
+		memcpy(&v, &s[i], sizeof(v));
+		h = (h ^ v) * m;
+		h ^= h >> 29;
+	}
+	if (i < n) {
+		h = (h ^ load_prefix(&s[i], n - i)) * m;
+	}
+	// Finalizer from MurmurHash3
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static void unique_set_free(unique_set *set) {
+	free(set->slots);
+	arena_free(&set->mem);
+	*set = (unique_set){ 0 };
+}
+
+static void unique_set_grow(unique_set *set) {
+	const size_t cap = set->cap ? set->cap * 2 : UNIQUE_SET_MIN_CAP;
+	unique_entry *slots = xmalloc(sizeof(unique_entry) * cap);
+	memset(slots, 0, sizeof(unique_entry) * cap);
+	for (size_t i = 0; i < set->cap; i++) {
+		const unique_entry *e = &set->slots[i];
+		if (e->str) {
+			size_t j = e->hash & (cap - 1);
+			while (slots[j].str) {
+				j = (j + 1) & (cap - 1);
+			}
+			slots[j] = *e;
+		}
+	}
+	free(set->slots);
+	set->slots = slots;
+	set->cap = cap;
+}
+
+// unique_set_insert adds a copy of s to the set and returns true if it was
+// not already a member.
+static bool unique_set_insert(unique_set *set, const char *s, size_t n) {
+	if ((set->len + 1) * 4 > set->cap * 3) {
+		unique_set_grow(set);
+	}
+	const uint64_t hash = hash_bytes(s, n);
+	size_t i = hash & (set->cap - 1);
+	for (;;) {
+		unique_entry *e = &set->slots[i];
+		if (!e->str) {
+			break;
+		}
+		if (e->hash == hash && e->len == n && memcmp(e->str, s, n) == 0) {
+			return false;
+		}
+		i = (i + 1) & (set->cap - 1);
+	}
+	// NB: empty strings need a non-NULL pointer to mark the slot as used.
+	char *p = arena_alloc(&set->mem, n > 0 ? n : 1);
+	set->slots[i] = (unique_entry){ hash, memcpy(p, s, n), n };
+	set->len++;
+	return true;
+}
+
+static int consume_stream(FILE **istreams, size_t nstreams, FILE *ostream,
+                          const unsigned char delim, bool no_strip_prefix,
+                          bool unique, size_t head) {
 	size_t buf_cap = 128;
+	size_t nout = 0;
 	char *buf = xmalloc(128);
+	char *scratch = NULL;
+	size_t scratch_cap = 0;
+	unique_set seen = { 0 };
+	writer out;
+	if (writer_init(&out, ostream) != 0) {
+		perror("fflush");
+		goto fatal_error;
+	}
 
-	ssize_t buf_len;
-	while ((buf_len = getdelim(&buf, &buf_cap, delim, istream)) != -1) {
-		size_t dlen = buf_len;
-		char *dst = no_strip_prefix
-			? buf
-			: trim_prefix_inplace(buf, buf_len, &dlen);
-		if (fwrite(dst, 1, dlen, ostream) < dlen) {
-			perror("fwrite");
+	for (size_t i = 0; i < nstreams; i++) {
+		FILE *istream = istreams[i];
+		// Lines read from a pipe are written in small batches so that a
+		// slow producer's output is not held back.
+		struct stat st;
+		const int fd = fileno(istream);
+		const bool regular = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+		if (writer_flush(&out) != 0) {
+			perror("writev");
 			goto fatal_error;
 		}
-	}
-	if (ferror(stdin)) {
-		if (errno != 0) {
-			perror("getdelim");
+		out.flush_size = regular ? WRITER_BUFFER_SIZE : WRITER_STREAM_FLUSH_SIZE;
+		ssize_t buf_len;
+		while ((buf_len = getdelim(&buf, &buf_cap, delim, istream)) != -1) {
+			if (head > 0 && nout == head) {
+				goto done;
+			}
+			size_t dlen = buf_len;
+			char *dst = no_strip_prefix
+				? buf
+				: trim_prefix_inplace(buf, buf_len, &dlen);
+			if (unique) {
+				// Compare the text of lines (ignoring ANSI escape sequences)
+				const char *key = dst;
+				size_t key_len = dlen;
+				if (contains_ansi_escape_code(dst, dlen)) {
+					if (scratch_cap < dlen) {
+						scratch_cap = dlen;
+						scratch = xrealloc(scratch, scratch_cap);
+					}
+					key_len = strip_ansi(scratch, dst, dlen);
+					key = scratch;
+				}
+				if (!unique_set_insert(&seen, key, key_len)) {
+					continue;
+				}
+			}
+			if (writer_copy(&out, dst, dlen) != 0) {
+				perror("writev");
+				goto fatal_error;
+			}
+			nout++;
+		}
+		if (ferror(istream)) {
+			if (errno != 0) {
+				perror("getdelim");
+			}
+			goto fatal_error;
 		}
+	}
+done:
+	if (writer_flush(&out) != 0) {
+		perror("writev");
 		goto fatal_error;
 	}
 	free(buf);
+	free(scratch);
+	unique_set_free(&seen);
+	writer_free(&out);
 	fflush(stdout);
 	return 0;
 
@@ -373,7 +2255,31 @@ Options:\n\
   -0, --print0   Line delimiter is NUL, not newline\n\
   -s, --sort     Sort lines before printing\n\
   -i, --isort    Sort lines case-insensitive before printing\n\
+      --fold     With --isort, ignore case while comparing lines instead\n\
+                 of storing a lower case copy of each line (uses less memory).\n\
+                 Requires --isort, cannot be used with --natural or --path\n\
+      --natural  When sorting, compare numbers by value (file2 < file10)\n\
+      --path     When sorting, order '/' before every other char so that\n\
+                 the contents of a directory sort right after it\n\
+  -u, --unique   Only print the first of equal lines (ignoring ANSI escape\n\
+                 codes and, with --isort, case)\n\
+      --head N   Only print the first N lines (the N smallest when sorting,\n\
+                 which only keeps N lines in memory)\n\
+      --incremental\n\
+                 With --sort or --isort, print lines while piped input is\n\
+                 still being read: whenever the input stalls (at most every\n\
+                 100ms) the lines read so far that sort after the last line\n\
+                 printed are printed. Lines that sort before an already\n\
+                 printed line are printed (sorted) after the input ends, so\n\
+                 the output is not globally sorted: it may be two sorted runs.\n\
+                 Regular files are read in full and sorted as usual.\n\
   -n, --no-strip Do not strip leading './' from input\n\
+  -S, --buffer-size SIZE\n\
+                 Use at most SIZE bytes of memory for lines when sorting,\n\
+                 larger inputs are sorted using temporary files (in $TMPDIR).\n\
+                 SIZE may be followed by one of the suffixes K, M, G or T.\n\
+  -j, --threads N\n\
+                 Use N threads when sorting (default: number of CPUs)\n\
   -v, --verbose  Print debug information\n\
   -h, --help     Print this help message and exit.\n", stdout);
 	}
@@ -383,14 +2289,75 @@ static inline bool streq(const char *s1, const char *s2) {
 	return strcmp(s1, s2) == 0;
 }
 
-static inline bool arg_equal(const char *argv, const char *short_name, const char *long_name) {
+static bool arg_equal(const char *argv, const char *short_name, const char *long_name) {
 	return (short_name && streq(argv, short_name)) || (long_name && streq(argv, long_name));
 }
 
-static int64_t timespec_nanos(struct timespec ts) {
-	int64_t sec = ts.tv_sec;
-	int64_t nsec = ts.tv_nsec;
-	return (sec * 1e9) + nsec;
+// parse_size parses a size in bytes with an optional K, M, G or T suffix.
+static bool parse_size(const char *s, size_t *size) {
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(s, &end, 10);
+	if (end == s || errno != 0 || *s == '-') {
+		return false;
+	}
+	int shift = 0;
+	switch (*end) {
+	case 'k': case 'K': shift = 10; end++; break;
+	case 'm': case 'M': shift = 20; end++; break;
+	case 'g': case 'G': shift = 30; end++; break;
+	case 't': case 'T': shift = 40; end++; break;
+	}
+	if (*end != '\0' || n > (SIZE_MAX >> shift)) {
+		return false;
+	}
+	*size = (size_t)n << shift;
+	return true;
+}
+
+// count_lines returns the number of lines in istream and rewinds it.
+static int64_t count_lines(FILE *istream, const unsigned char delim) {
+	char buf[64 * 1024];
+	int64_t lines = 0;
+	size_t n;
+	bool partial = false; // last line does not end with delim
+	while ((n = fread(buf, 1, sizeof(buf), istream)) > 0) {
+		const char *p = buf;
+		const char *end = &buf[n];
+		while ((p = memchr(p, delim, (size_t)(end - p))) != NULL) {
+			lines++;
+			p++;
+		}
+		partial = buf[n - 1] != (char)delim;
+	}
+	if (ferror(istream) || fseek(istream, 0, SEEK_SET) != 0) {
+		return -1;
+	}
+	return lines + (partial ? 1 : 0);
+}
+
+static int compare_int64(const void *p1, const void *p2) {
+	int64_t i1 = *(const int64_t *)p1;
+	int64_t i2 = *(const int64_t *)p2;
+	return i1 == i2 ? 0 : i1 < i2 ? -1 : 1;
+}
+
+// bench_iteration processes istream once and rewinds it.
+static int bench_iteration(FILE *istream, FILE *ostream, bool sort,
+                           const unsigned char delim, const sort_options *opts) {
+	int ret = sort
+		? consume_stream_sort(&istream, 1, ostream, delim, opts)
+		: consume_stream(&istream, 1, ostream, delim, opts->no_strip_prefix,
+			opts->unique, opts->head);
+	if (ret != 0) {
+		fprintf(stderr, sort ? "consume_stream_sort\n" : "consume_stream\n");
+		return ret;
+	}
+	if (fseek(istream, 0, SEEK_SET) != 0) {
+		perror("fseek");
+		return -1;
+	}
+	return 0;
 }
 
 int main(int argc, char const *argv[]) {
@@ -402,6 +2369,16 @@ int main(int argc, char const *argv[]) {
 	bool invalid_flag = false;
 	bool print_help = false;
 	bool verbose = false;
+	bool fold_case = false;
+	bool unique = false;
+	size_t head = 0;
+	bool incremental = false;
+	line_order order = ORDER_BYTES;
+	long sort_threads = 0;
+	size_t buffer_size = 0;
+
+	const char **files = xmalloc(sizeof(char *) * argc);
+	size_t nfiles = 0;
 
 	bool run_benchmarks = false;
 	char *bench_filename = NULL;
@@ -432,6 +2409,34 @@ int main(int argc, char const *argv[]) {
 				invalid_flag = true;
 			}
 			sort_lines_case = true;
+		} else if (streq(argv[i], "--fold")) {
+			fold_case = true;
+		} else if (arg_equal(argv[i], "-u", "--unique")) {
+			unique = true;
+		} else if (streq(argv[i], "--natural")) {
+			order |= ORDER_NATURAL;
+		} else if (streq(argv[i], "--path")) {
+			order |= ORDER_PATH;
+		} else if (streq(argv[i], "--incremental")) {
+			incremental = true;
+		} else if (streq(argv[i], "--head")) {
+			if (i + 1 == argc) {
+				fprintf(stderr,"%s: missing argument to '%s' flag\n",
+					PROGRAM_NAME, argv[i]);
+				invalid_flag = true;
+			} else {
+				char *end;
+				const char *arg = argv[++i];
+				errno = 0;
+				unsigned long long n = strtoull(arg, &end, 10);
+				if (end == arg || *end != '\0' || *arg == '-' || errno != 0 ||
+				    n == 0 || n > SIZE_MAX / sizeof(head_entry)) {
+					fprintf(stderr,"%s: invalid number of lines: '%s'\n",
+						PROGRAM_NAME, arg);
+					invalid_flag = true;
+				}
+				head = n;
+			}
 		} else if (arg_equal(argv[i], "-n", "--no-strip")) {
 			if (no_strip_prefix) {
 				fprintf(stderr,"%s: do not strip leading './' flag ['-n', '--no-strip'] specified twice\n",
@@ -439,6 +2444,31 @@ int main(int argc, char const *argv[]) {
 				invalid_flag = true;
 			}
 			no_strip_prefix = true;
+		} else if (arg_equal(argv[i], "-j", "--threads")) {
+			if (i + 1 == argc) {
+				fprintf(stderr,"%s: missing argument to '%s' flag\n",
+					PROGRAM_NAME, argv[i]);
+				invalid_flag = true;
+			} else {
+				char *end;
+				const char *arg = argv[++i];
+				sort_threads = strtol(arg, &end, 10);
+				if (end == arg || *end != '\0' || sort_threads < 1) {
+					fprintf(stderr,"%s: invalid number of threads: '%s'\n",
+						PROGRAM_NAME, arg);
+					invalid_flag = true;
+				}
+			}
+		} else if (arg_equal(argv[i], "-S", "--buffer-size")) {
+			if (i + 1 == argc) {
+				fprintf(stderr,"%s: missing argument to '%s' flag\n",
+					PROGRAM_NAME, argv[i]);
+				invalid_flag = true;
+			} else if (!parse_size(argv[++i], &buffer_size) || buffer_size == 0) {
+				fprintf(stderr,"%s: invalid buffer size: '%s'\n",
+					PROGRAM_NAME, argv[i]);
+				invalid_flag = true;
+			}
 		} else if (arg_equal(argv[i], "-v", "--verbose")) {
 			verbose = true;
 		} else if (arg_equal(argv[i], "-h", "--help")) {
@@ -461,52 +2491,126 @@ int main(int argc, char const *argv[]) {
 			}
 			run_benchmarks = true;
 
+		} else if (argv[i][0] != '-' || streq(argv[i], "-")) {
+			files[nfiles++] = argv[i];
 		} else {
 			fprintf(stderr, "%s: unrecognized option: '%s'\n", PROGRAM_NAME, argv[i]);
 			invalid_flag = true;
 		}
 	}
+	if (fold_case && (!sort_lines_case || order != ORDER_BYTES)) {
+		fprintf(stderr, "%s: --fold requires --isort and cannot be combined with "
+			"--natural or --path\n", PROGRAM_NAME);
+		invalid_flag = true;
+	}
+	if (incremental && (unique || head > 0 || buffer_size > 0)) {
+		fprintf(stderr, "%s: --incremental cannot be combined with --unique, "
+			"--head or --buffer-size\n", PROGRAM_NAME);
+		invalid_flag = true;
+	}
 	if (verbose) {
 		fprintf(stderr, "# debug: command line arguments:\n");
 		fprintf(stderr, "#   null_terminate:  %s\n", fmt_bool(null_terminate));
 		fprintf(stderr, "#   no_strip_prefix: %s\n", fmt_bool(no_strip_prefix));
 		fprintf(stderr, "#   sort_lines:      %s\n", fmt_bool(sort_lines));
 		fprintf(stderr, "#   sort_lines_case: %s\n", fmt_bool(sort_lines_case));
+		fprintf(stderr, "#   fold_case:       %s\n", fmt_bool(fold_case));
+		fprintf(stderr, "#   unique:          %s\n", fmt_bool(unique));
+		fprintf(stderr, "#   head:            %zu\n", head);
+		fprintf(stderr, "#   incremental:     %s\n", fmt_bool(incremental));
+		fprintf(stderr, "#   natural:         %s\n", fmt_bool(order & ORDER_NATURAL));
+		fprintf(stderr, "#   path:            %s\n", fmt_bool(order & ORDER_PATH));
 		fprintf(stderr, "#   invalid_flag:    %s\n", fmt_bool(invalid_flag));
 		fprintf(stderr, "#   print_help:      %s\n", fmt_bool(print_help));
 		fprintf(stderr, "#   verbose:         %s\n", fmt_bool(verbose));
+		fprintf(stderr, "#   sort_threads:    %li\n", sort_threads);
+		fprintf(stderr, "#   buffer_size:     %zu\n", buffer_size);
 		fprintf(stderr, "#   run_benchmarks:  %s\n", fmt_bool(run_benchmarks));
 		fprintf(stderr, "#   bench_filename:  %s\n", bench_filename ? bench_filename : "NULL");
 		fprintf(stderr, "#   bench_count:     %li\n", bench_count);
+		for (size_t i = 0; i < nfiles; i++) {
+			fprintf(stderr, "#   file:            %s\n", files[i]);
+		}
 		fprintf(stderr, "\n");
 	}
 	if (invalid_flag || print_help) {
+		free(files);
 		free(bench_filename);
 		print_usage(invalid_flag); // print to stderr if there is an invalid flag
 		return invalid_flag ? 2 : 0;
 	}
 
 	const unsigned char delim = null_terminate ? 0 : '\n';
+	if (sort_threads == 0) {
+		sort_threads = default_sort_threads();
+	}
+	const sort_options opts = {
+		.ignore_case     = sort_lines_case,
+		// NB: --fold is rejected with --natural and --path since their keys
+		// are lowered before they are transformed (folding case while
+		// comparing would also fold the bytes of the keys).
+		.fold_case       = fold_case,
+		.no_strip_prefix = no_strip_prefix,
+		.nthreads        = sort_threads,
+		.buffer_size     = buffer_size,
+		.unique          = unique,
+		.head            = head,
+		.incremental     = incremental,
+		.order           = order,
+	};
 
 	if (!run_benchmarks) {
 		int exit_code = 0;
+		FILE **istreams = xmalloc(sizeof(FILE *) * (nfiles + 1));
+		size_t nstreams = 0;
+		if (nfiles == 0) {
+			istreams[nstreams++] = stdin;
+		}
+		for (size_t i = 0; i < nfiles; i++) {
+			if (streq(files[i], "-")) {
+				istreams[nstreams++] = stdin;
+				continue;
+			}
+			FILE *f = fopen(files[i], "r");
+			if (!f) {
+				fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, files[i], strerror(errno));
+				exit_code = 1;
+				goto exit;
+			}
+			istreams[nstreams++] = f;
+		}
 		if (sort_lines || sort_lines_case) {
-			exit_code = consume_stream_sort(stdin, stdout, delim, sort_lines_case,
-				no_strip_prefix);
+			exit_code = consume_stream_sort(istreams, nstreams, stdout, delim, &opts);
 		} else {
-			exit_code = consume_stream(stdin, stdout, delim, no_strip_prefix);
+			exit_code = consume_stream(istreams, nstreams, stdout, delim,
+				no_strip_prefix, unique, head);
+		}
+	exit:
+		for (size_t i = 0; i < nstreams; i++) {
+			if (istreams[i] != stdin) {
+				fclose(istreams[i]);
+			}
 		}
+		free(istreams);
+		free(files);
 		if (bench_filename) {
 			free(bench_filename);
 		}
 		return exit_code;
 	}
+	free(files);
 
 	// Run benchmarks
-	struct timespec start;
 	FILE *ostream = NULL;
+	int64_t *times = NULL;
 	int exit_code = 1;
 
+	if (bench_count < 1) {
+		fprintf(stderr, "%s: invalid benchmark count: %li\n", PROGRAM_NAME, bench_count);
+		free(bench_filename);
+		return 2;
+	}
+
 	FILE *istream = fopen(bench_filename, "r");
 	if (!istream) {
 		perror("fopen (bench file)");
@@ -523,11 +2627,14 @@ int main(int argc, char const *argv[]) {
 		perror("fseek (bench file)");
 		goto bench_exit;
 	}
+	const int64_t file_lines = count_lines(istream, delim);
+	if (file_lines < 0) {
+		perror("fread (bench file)");
+		goto bench_exit;
+	}
 	const double file_mbs = (double)file_bytes / (double)(1024 * 1024);
-	fprintf(stderr, "benchmark: n: %li file: %s size: %.2f\n",
-			bench_count, bench_filename, file_mbs);
-
-	timespec_get(&start, TIME_UTC);
+	fprintf(stderr, "benchmark: n: %li file: %s size: %.2f lines: %" PRId64 "\n",
+			bench_count, bench_filename, file_mbs, file_lines);
 
 	ostream = fopen("/dev/null", "w");
 	if (!ostream) {
@@ -535,45 +2642,65 @@ int main(int argc, char const *argv[]) {
 		goto bench_exit;
 	}
 
-	if (sort_lines || sort_lines_case) {
-		for (long i = 0; i < bench_count; i++) {
-			int ret = consume_stream_sort(istream, ostream, delim, sort_lines_case,
-				no_strip_prefix);
-			if (ret != 0) {
-				fprintf(stderr, "consume_stream_sort\n");
-				goto bench_exit;
-			}
-			if (fseek(istream, 0, SEEK_SET) != 0) {
-				perror("fseek");
-				goto bench_exit;
-			}
+	const bool sort = sort_lines || sort_lines_case;
+	times = xmalloc(sizeof(int64_t) * (size_t)bench_count);
+	const size_t calls_start = alloc_calls;
+	const size_t bytes_start = alloc_bytes;
+	int64_t ns = 0;
+	for (long i = 0; i < bench_count; i++) {
+		int64_t start = monotonic_nanos();
+		if (bench_iteration(istream, ostream, sort, delim, &opts) != 0) {
+			goto bench_exit;
 		}
-	} else {
-		for (long i = 0; i < bench_count; i++) {
-			int ret = consume_stream(istream, ostream, delim, no_strip_prefix);
-			if (ret != 0) {
-				fprintf(stderr, "consume_stream\n");
-				goto bench_exit;
-			}
-			if (fseek(istream, 0, SEEK_SET) != 0) {
-				perror("fseek");
-				goto bench_exit;
-			}
+		times[i] = monotonic_nanos() - start;
+		ns += times[i];
+	}
+	const double calls = (double)(alloc_calls - calls_start) / (double)bench_count;
+	const double alloc_mbs = (double)(alloc_bytes - bytes_start) /
+		(double)bench_count / (double)(1024 * 1024);
+
+	// Collect the phase breakdown in a separate iteration since timing
+	// phases (every line for PHASE_STRIP) adds overhead.
+	int64_t phases[PHASE_COUNT] = { 0 };
+	if (sort) {
+		bench_phases = phases;
+		int ret = bench_iteration(istream, ostream, sort, delim, &opts);
+		bench_phases = NULL;
+		if (ret != 0) {
+			goto bench_exit;
 		}
 	}
 
-	struct timespec end;
-	timespec_get(&end, TIME_UTC);
+	qsort(times, (size_t)bench_count, sizeof(int64_t), compare_int64);
+	const size_t p99 = (size_t)((((double)bench_count * 99) + 99) / 100) - 1;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
 
 	// ns and secs are total
-	int64_t ns = timespec_nanos(end) - timespec_nanos(start);
-	double secs = (double)(ns / 1e9);
+	double secs = (double)ns / 1e9;
 	fprintf(stderr, "duration:   %.3fs\n", secs);
 	fprintf(stderr, "average:    %.3fs\n", secs/(double)bench_count);
+	fprintf(stderr, "min:        %.3fs\n", (double)times[0] / 1e9);
+	fprintf(stderr, "median:     %.3fs\n", (double)times[bench_count / 2] / 1e9);
+	fprintf(stderr, "p99:        %.3fs\n", (double)times[p99] / 1e9);
 	fprintf(stderr, "throughput: %.3f MB/s\n", (1 / secs) * (file_mbs * (double)bench_count));
+	fprintf(stderr, "lines/s:    %.0f\n", (double)file_lines * (double)bench_count / secs);
+	fprintf(stderr, "xallocs:    %.0f (%.2f MB) per iteration (xmalloc/xrealloc only)\n",
+		calls, alloc_mbs);
+	fprintf(stderr, "peak rss:   %.2f MB\n", (double)usage.ru_maxrss / 1024);
+	if (sort) {
+		// NB: PHASE_READ includes PHASE_STRIP
+		phases[PHASE_READ] -= phases[PHASE_STRIP];
+		fprintf(stderr, "phases:\n");
+		for (int i = 0; i < PHASE_COUNT; i++) {
+			fprintf(stderr, "  %-6s    %.3fs\n", bench_phase_names[i],
+				(double)phases[i] / 1e9);
+		}
+	}
 	exit_code = 0;
 
 bench_exit:
+	free(times);
 	if (istream) {
 		fclose(istream);
 	}
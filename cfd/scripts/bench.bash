@@ -47,19 +47,19 @@ unzstd -q -o "${LINUX_COLOR}" ./testdata/bench/linux_color.txt.zst
 unzstd -q -o "${LINUX_NO_COLOR}" ./testdata/bench/linux_no_color.txt.zst
 
 _bench 'no-sort (no-color)'
-hyperfine --warmup 2 "'${CFD}' --bench 5 --benchfile '${LINUX_NO_COLOR}'"
+"${CFD}" --bench 10 --benchfile "${LINUX_NO_COLOR}"
 
 _bench 'sort (no-color)'
-hyperfine --warmup 2 "'${CFD}' --bench 5 --benchfile '${LINUX_NO_COLOR}' --sort"
+"${CFD}" --bench 10 --benchfile "${LINUX_NO_COLOR}" --sort
 
 _bench 'isort (no-color)'
-hyperfine --warmup 2 "'${CFD}' --bench 5 --benchfile '${LINUX_NO_COLOR}' --isort"
+"${CFD}" --bench 10 --benchfile "${LINUX_NO_COLOR}" --isort
 
 _bench 'no-sort (color)'
-hyperfine --warmup 2 "'${CFD}' --bench 5 --benchfile '${LINUX_COLOR}'"
+"${CFD}" --bench 10 --benchfile "${LINUX_COLOR}"
 
 _bench 'sort (color)'
-hyperfine --warmup 2 "'${CFD}' --bench 5 --benchfile '${LINUX_COLOR}' --sort"
+"${CFD}" --bench 10 --benchfile "${LINUX_COLOR}" --sort
 
 _bench 'isort (color)'
-hyperfine --warmup 2 "'${CFD}' --bench 5 --benchfile '${LINUX_COLOR}' --isort"
+"${CFD}" --bench 10 --benchfile "${LINUX_COLOR}" --isort
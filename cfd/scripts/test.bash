@@ -95,6 +95,116 @@ _test 'isort'
 diff "${DIR}/testdata/fd_test/want_isort.out" <(echo "${FD_TEST}" |
     "${CFD}" --isort) || _error "failed: ${TESTNAME}"
 
+_test 'isort (fold)'
+diff "${DIR}/testdata/fd_test/want_isort.out" <(echo "${FD_TEST}" |
+    "${CFD}" --isort --fold) || _error "failed: ${TESTNAME}"
+
+_test 'fold (invalid)'
+for FLAGS in '--fold' '--sort --fold' '--isort --fold --natural' '--isort --fold --path'; do
+    # shellcheck disable=SC2086
+    if echo "${FD_TEST}" | "${CFD}" ${FLAGS} >/dev/null 2>&1; then
+        _error "failed: ${TESTNAME}: accepted: ${FLAGS}"
+    fi
+done
+
+_test 'sort (threads)'
+diff "${DIR}/testdata/fd_test/want_sort.out" <(echo "${FD_TEST}" |
+    "${CFD}" --sort --threads 4) || _error "failed: ${TESTNAME}"
+
+# The parallel sort is only used for inputs larger than PARALLEL_SORT_MIN_KEYS
+# (64K) lines per thread so generate enough lines for 4 threads.
+PARALLEL_TEST="$(mktemp)"
+awk 'BEGIN {
+    srand(1);
+    for (i = 0; i < 300000; i++) {
+        n = int(rand() * 1000000);
+        if (i % 3 == 0) {
+            printf "\033[01;34mdir%d/\033[0mFile_%d.txt\n", n % 97, n;
+        } else {
+            printf "dir%d/file_%d.c\n", n % 97, n;
+        }
+    }
+}' >"${PARALLEL_TEST}"
+
+_test 'sort (parallel)'
+diff <("${CFD}" --sort --threads 1 "${PARALLEL_TEST}") \
+    <("${CFD}" --sort --threads 4 "${PARALLEL_TEST}") || _error "failed: ${TESTNAME}"
+
+_test 'isort (parallel)'
+diff <("${CFD}" --isort --threads 1 "${PARALLEL_TEST}") \
+    <("${CFD}" --isort --threads 4 "${PARALLEL_TEST}") || _error "failed: ${TESTNAME}"
+rm "${PARALLEL_TEST}"
+
+_test 'sort (buffer-size)'
+diff "${DIR}/testdata/fd_test/want_sort.out" <(echo "${FD_TEST}" |
+    "${CFD}" --sort --buffer-size 1K) || _error "failed: ${TESTNAME}"
+
+_test 'sort (unique)'
+diff "${DIR}/testdata/fd_test/want_sort.out" <(printf '%s\n%s\n' "${FD_TEST}" "${FD_TEST}" |
+    "${CFD}" --sort --unique) || _error "failed: ${TESTNAME}"
+
+_test 'sort (head)'
+diff <(head -n 10 "${DIR}/testdata/fd_test/want_sort.out") <(echo "${FD_TEST}" |
+    "${CFD}" --sort --head 10) || _error "failed: ${TESTNAME}"
+
+_test 'sort (incremental)'
+diff "${DIR}/testdata/fd_test/want_sort.out" <(echo "${FD_TEST}" |
+    "${CFD}" --sort --incremental) || _error "failed: ${TESTNAME}"
+
+# Regular files are read in full before anything is printed, even when
+# reading them takes longer than the flush interval (100ms).
+INCREMENTAL_TEST="$(mktemp)"
+awk 'BEGIN {
+    srand(2);
+    for (i = 0; i < 1000000; i++) {
+        printf "dir%d/file_%d.c\n", int(rand() * 97), int(rand() * 1000000);
+    }
+}' >"${INCREMENTAL_TEST}"
+
+_test 'sort (incremental file)'
+diff <("${CFD}" --sort "${INCREMENTAL_TEST}") \
+    <("${CFD}" --sort --incremental "${INCREMENTAL_TEST}") || _error "failed: ${TESTNAME}"
+
+_test 'sort (incremental stdin file)'
+diff <("${CFD}" --sort "${INCREMENTAL_TEST}") \
+    <("${CFD}" --sort --incremental <"${INCREMENTAL_TEST}") || _error "failed: ${TESTNAME}"
+
+# Piped input that stalls is printed in at most two sorted runs.
+_test 'sort (incremental stall)'
+INCREMENTAL_OUT="$(mktemp)"
+{
+    tail -n 1000 "${INCREMENTAL_TEST}"
+    sleep 0.5
+    head -n 1000 "${INCREMENTAL_TEST}"
+} | "${CFD}" --sort --incremental >"${INCREMENTAL_OUT}"
+diff <({
+    tail -n 1000 "${INCREMENTAL_TEST}"
+    head -n 1000 "${INCREMENTAL_TEST}"
+} | "${CFD}" --sort) <("${CFD}" --sort "${INCREMENTAL_OUT}") || _error "failed: ${TESTNAME}"
+RUNS="$(LC_ALL=C awk 'NR > 1 && $0 < prev { n++ } { prev = $0 } END { print n + 1 }' \
+    "${INCREMENTAL_OUT}")"
+((RUNS <= 2)) || _error "failed: ${TESTNAME}: ${RUNS} sorted runs"
+rm "${INCREMENTAL_TEST}" "${INCREMENTAL_OUT}"
+
+_test 'sort (natural)'
+diff <(printf '%s\n' file1 file2 file10) <(printf '%s\n' file10 file2 file1 |
+    "${CFD}" --sort --natural) || _error "failed: ${TESTNAME}"
+
+_test 'sort (natural unique)'
+diff <(printf '%s\n' file1 file01 file001) <(printf '%s\n' file01 file1 file001 file01 |
+    "${CFD}" --sort --natural --unique) || _error "failed: ${TESTNAME}"
+
+_test 'sort (path)'
+diff <(printf '%s\n' a a/b a-b) <(printf '%s\n' a-b a/b a |
+    "${CFD}" --sort --path) || _error "failed: ${TESTNAME}"
+
+_test 'sort (file)'
+FD_TEST_FILE="$(mktemp)"
+echo "${FD_TEST}" >"${FD_TEST_FILE}"
+diff "${DIR}/testdata/fd_test/want_sort.out" <("${CFD}" --sort "${FD_TEST_FILE}") ||
+    _error "failed: ${TESTNAME}"
+rm "${FD_TEST_FILE}"
+
 # GOROOT
 
 if command -v go >/dev/null && [[ -d "$(go env GOROOT)" ]]; then
@@ -130,6 +240,11 @@ if command -v go >/dev/null && [[ -d "$(go env GOROOT)" ]]; then
     diff "${DIFF_FLAGS[@]}" \
         <(sed 's/^\.\///g' "${ALL_GO}" | "${PYISORT}" --ignore-case) \
         <("${CFD}" --isort <"${ALL_GO}")
+
+    _test 'GOROOT: sort (threads)'
+    diff "${DIFF_FLAGS[@]}" \
+        <("${CFD}" --sort --threads 1 <"${ALL_GO_COLOR}") \
+        <("${CFD}" --sort --threads 8 <"${ALL_GO_COLOR}")
 else
     echo "${YELLOW}skip:${RESET} skipping GOROOT test: go not installed"
 fi
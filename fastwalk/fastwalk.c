@@ -7,8 +7,15 @@
 #include <assert.h>
 #include <pthread.h>
 #include <unistd.h>
-
-#include <ftw.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#define WALKER_USE_GETDENTS 1
+#endif
 
 #include <stdatomic.h>
 
@@ -18,33 +25,6 @@
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #endif
 
-typedef struct queue_node queue_node;
-
-struct queue_node {
-	queue_node *next;
-	void      *value;
-};
-
-queue_node *new_queue_node(void *value) {
-	queue_node *node = malloc(sizeof(queue_node));
-	if (unlikely(!node)) {
-		assert(node);
-		return NULL;
-	}
-	node->next = NULL;
-	node->value = value;
-	return node;
-}
-
-typedef struct {
-	pthread_mutex_t lock;
-	size_t          len;
-	queue_node      *head;
-	queue_node      *tail;
-	pthread_cond_t  cond; // TODO: move to top ???
-	int             closed; // TODO: implement this
-} queue;
-
 #define __queue_pthread_fatal(_errnum, _op)                             \
 	do {                                                                \
 		((void)fprintf(stderr, "%s:%d error (%d): %s: %s\n",            \
@@ -69,523 +49,895 @@ typedef struct {
 		}                                                                \
 	} while (0)
 
-int queue_init(queue *q) {
-	int res;
+enum walker_status {
+	W_SKIP_DIR      = -1,
+	W_SKIP_FILES    = -2,
+	W_TRAVERSE_LINK = -3,
+};
 
-	pthread_mutexattr_t mattr;
-	if ((res = pthread_mutexattr_init(&mattr) != 0)) {
-		__queue_pthread_fatal(res, "pthread_mutexattr_init");
-		return res;
-	}
-	*q = (queue){ .lock = { 0 }, .cond = { 0 } };
-	if ((res = pthread_mutex_init(&q->lock, &mattr) != 0)) {
-		__queue_pthread_fatal(res, "pthread_mutex_init");
-		return res;
-	}
-	if ((res = pthread_mutexattr_destroy(&mattr) != 0)) {
-		__queue_pthread_fatal(res, "pthread_mutexattr_destroy");
-		return res;
-	}
+// walk_func is called for every entry found by the walker (but not the
+// root) with an open fd of its directory, its name, its full path and its
+// d_type. The fd and strings are borrowed and only valid during the call
+// (name and path are in the worker's path buffer). It is called concurrently
+// from all of the worker threads. Returning W_SKIP_DIR for a directory stops
+// the walker from descending into it, W_SKIP_FILES skips the remaining
+// regular files of the current directory, W_TRAVERSE_LINK for a symbolic
+// link to a directory walks the directory as if it was at the link's path
+// and any other non-zero value stops the walk.
+//
+// Like find -L, a link is not followed if its target is the directory being
+// read or one of its ancestors (a cycle), otherwise a directory reached
+// through several links is walked once for each of them.
+//
+// The type is never DT_UNKNOWN: on file systems that do not report it
+// (XFS without ftype, some NFS and overlayfs setups) it is resolved with
+// fstatat on the open directory.
+typedef int (*walk_func)(int dirfd, const char *name, const char *path, int typ);
+
+// Directories
+//
+// A walk_dir is a directory that still needs to be read. It is opened with
+// openat relative to its parent, which is kept open (and shared by all of
+// its subdirectories) until the last of them has been opened, so the kernel
+// does not resolve the full path again. The number of parents kept open is
+// limited by WALKER_MAX_OPEN_DIRS and RLIMIT_NOFILE; past that directories
+// are opened by their full path. If opening a directory fails with EMFILE
+// the fds of the parents that are no longer being read are closed (their
+// subdirectories fall back to the full path) and the open is retried.
+//
+// Each walk_dir references its parent walk_dir (up), which is kept until all
+// of its subdirectories have been read, so that the ancestors of a directory
+// can be checked for cycles when following a link. Its (dev, ino) is
+// recorded when it is opened.
+
+#define WALKER_MAX_OPEN_DIRS 512
+
+// Number of fds left for the callback, stdio and the like when deriving
+// the limit from RLIMIT_NOFILE.
+#define WALKER_RESERVED_FDS 16
+
+typedef struct walk_dirfd walk_dirfd;
+
+struct walk_dirfd {
+	int        fd;      // -1 once evicted
+	atomic_int refs;
+	bool       reading; // the directory is still being read from fd
+	walk_dirfd *prev;
+	walk_dirfd *next;
+};
 
-	pthread_condattr_t cattr;
-	if ((res = pthread_condattr_init(&cattr) != 0)) {
-		__queue_pthread_fatal(res, "pthread_condattr_init");
-		return res;
-	}
-	if ((res = pthread_cond_init(&q->cond, &cattr) != 0)) {
-		__queue_pthread_fatal(res, "pthread_cond_init");
-		return res;
-	}
-	if ((res = pthread_condattr_destroy(&cattr)) != 0) {
-		__queue_pthread_fatal(res, "pthread_condattr_destroy");
-		return res;
-	}
+typedef struct walk_dir walk_dir;
+
+struct walk_dir {
+	walk_dirfd *parent;   // open parent directory (NULL: use path)
+	walk_dir   *up;       // parent directory (NULL: root)
+	atomic_int refs;      // 1 until read + 1 for each subdirectory
+	bool       root;      // the root of the walk
+	bool       has_id;    // dev and ino are set (once it is opened)
+	dev_t      dev;
+	ino_t      ino;
+	size_t     name_off;  // offset of the name of the directory in path
+	size_t     len;
+	char       path[];
+};
 
-	queue_node *node = new_queue_node(NULL);
-	if (!node) {
-		assert(node);
-		return ENOMEM;
+static walk_dir *walk_dir_new(walk_dirfd *parent, walk_dir *up, const char *path,
+                              size_t len, size_t name_off) {
+	walk_dir *d = malloc(sizeof(walk_dir) + len + 1);
+	if (unlikely(!d)) {
+		fprintf(stderr, "walk_dir_new: OOM\n");
+		assert(d);
+		exit(1);
 	}
-	q->head = node;
-	q->tail = node;
-	return 0;
+	d->parent = parent;
+	d->up = up;
+	if (up) {
+		atomic_fetch_add(&up->refs, 1);
+	}
+	atomic_init(&d->refs, 1);
+	d->root = false;
+	d->has_id = false;
+	d->name_off = name_off;
+	d->len = len;
+	memcpy(d->path, path, len);
+	d->path[len] = '\0';
+	return d;
 }
 
-bool queue_is_closed(queue *q) {
-	queue_lock(q);
-	bool closed = q->closed != 0;
-	queue_unlock(q);
-	return closed;
-}
-
-int queue_close(queue *q) {
-	queue_lock(q);
-	int ret = q->closed ? EINVAL : 0;
-	q->closed++;
-	queue_unlock(q);
-	if (ret == 0) {
-		pthread_cond_broadcast(&q->cond);
+// walk_dir_release drops a reference to d and frees it (and any of its
+// ancestors) that are no longer referenced.
+static void walk_dir_release(walk_dir *d) {
+	while (d && atomic_fetch_sub(&d->refs, 1) == 1) {
+		walk_dir *up = d->up;
+		free(d);
+		d = up;
 	}
-	return ret;
 }
 
-// static inline int __queue_open(queue *q) { return q->closed == 0; }
+// Work-stealing deque
+//
+// Each worker owns a deque of directories that still need to be read. The
+// owner pushes and pops at the bottom (so it walks depth first and stays
+// close to the directories it just read) while idle workers steal from the
+// top, which holds the oldest and usually largest subtrees. Directory reads
+// dominate the cost so a lock per deque is cheap enough and far simpler
+// than a lock-free Chase-Lev deque.
 
-// int queue_open(queue *q) {
-// 	queue_lock(q);
-// 	int open = __queue_open(q);
-// 	queue_unlock(q);
-// 	return open;
-// }
+typedef struct {
+	pthread_mutex_t lock;
+	walk_dir        **buf; // ring buffer of cap entries
+	size_t          cap;   // always a power of two
+	size_t          head;  // index of the top (oldest) entry
+	size_t          len;
+} deque;
 
-size_t queue_len(queue *q) {
-	queue_lock(q);
-	size_t len = q->len;
-	queue_unlock(q);
-	return len;
-}
+#define DEQUE_INITIAL_CAP 64
 
-int queue_push(queue *q, void *val) {
-	queue_node *node = new_queue_node(val);
-	queue_lock(q);
-	q->tail->next = node;
-	q->tail = node;
-	q->len++;
-	queue_unlock(q);
-	pthread_cond_signal(&q->cond);
+static int deque_init(deque *d) {
+	int res;
+	if ((res = pthread_mutex_init(&d->lock, NULL)) != 0) {
+		__queue_pthread_fatal(res, "pthread_mutex_init");
+		return res;
+	}
+	d->buf = malloc(DEQUE_INITIAL_CAP * sizeof(walk_dir *));
+	if (!d->buf) {
+		pthread_mutex_destroy(&d->lock);
+		return ENOMEM;
+	}
+	d->cap = DEQUE_INITIAL_CAP;
+	d->head = 0;
+	d->len = 0;
 	return 0;
 }
 
-void *queue_pop(queue *q) {
-	void *val = NULL;
-	queue_lock(q);
-	queue_node *head = q->head;
-	if (head != q->tail) {
-		val = head->value;
-		q->head = head->next;
-		q->len--;
-		free(head);
+static void deque_free(deque *d) {
+	for (size_t i = 0; i < d->len; i++) {
+		walk_dir_release(d->buf[(d->head + i) & (d->cap - 1)]);
 	}
-	queue_unlock(q);
-	// TODO: signal waiters
-	return val;
+	free(d->buf);
+	pthread_mutex_destroy(&d->lock);
 }
 
-void *queue_pop_wait(queue *q) {
-	queue_lock(q);
-	while (q->head == q->tail && !q->closed) {
-		pthread_cond_wait(&q->cond, &q->lock);
+static void deque_push_bottom(deque *d, walk_dir *dir) {
+	queue_lock(d);
+	if (unlikely(d->len == d->cap)) {
+		walk_dir **buf = malloc(2 * d->cap * sizeof(walk_dir *));
+		if (unlikely(!buf)) {
+			fprintf(stderr, "deque_push_bottom: OOM\n");
+			assert(buf);
+			exit(1);
+		}
+		for (size_t i = 0; i < d->len; i++) {
+			buf[i] = d->buf[(d->head + i) & (d->cap - 1)];
+		}
+		free(d->buf);
+		d->buf = buf;
+		d->cap *= 2;
+		d->head = 0;
+	}
+	d->buf[(d->head + d->len) & (d->cap - 1)] = dir;
+	d->len++;
+	queue_unlock(d);
+}
+
+static walk_dir *deque_pop_bottom(deque *d) {
+	walk_dir *dir = NULL;
+	queue_lock(d);
+	if (d->len > 0) {
+		d->len--;
+		dir = d->buf[(d->head + d->len) & (d->cap - 1)];
 	}
-	// WARN: figure out what close should look like
-	void *val = NULL;
-	if (q->head != q->tail) {
-		queue_node *head = q->head;
-		val = head->value;
-		q->head = head->next;
-		q->len--;
-		free(head);
+	queue_unlock(d);
+	return dir;
+}
+
+static walk_dir *deque_steal_top(deque *d) {
+	walk_dir *dir = NULL;
+	queue_lock(d);
+	if (d->len > 0) {
+		dir = d->buf[d->head];
+		d->head = (d->head + 1) & (d->cap - 1);
+		d->len--;
 	}
-	queue_unlock(q);
-	return val;
+	queue_unlock(d);
+	return dir;
 }
 
-enum walker_status {
-	W_SKIP_DIR      = -1,
-	W_SKIP_FILES    = -2,
-	W_TRAVERSE_LINK = -3,
-};
+// Parallel walker
+//
+// Termination: pending counts the directories that have been pushed but not
+// yet fully read. It is incremented before a directory is pushed and
+// decremented after all of its subdirectories have been pushed, so it only
+// drops to zero once the whole tree has been read. Idle workers sleep on
+// idle_cond. To avoid lost wakeups they record version (which is bumped on
+// every push) before looking for work and only sleep if it is unchanged.
 
-typedef int (*walk_func)(const char *path, int typ);
+typedef struct walker walker;
 
-typedef struct {
-	walk_func fn;
-	queue     *workc;
-	queue     *enqueuec;
-	atomic_bool done;
-} walker;
+// Size of the buffer each worker reads directory entries into with
+// getdents64. It is much larger than the 32KB used by glibc's readdir so
+// most directories are read with a single system call.
+#define WALKER_DENTS_SIZE (256 * 1024)
 
-typedef struct {
-	walker *w;
-	const char *dir;
-} walk_context;
+// Each worker builds the path of every entry in its own path buffer: the
+// name is appended to the path of the directory being read and removed
+// again after the callback returns, so only directories are allocated.
+#define WALKER_PATH_INITIAL_CAP 4096
 
 typedef struct {
-	const char *dir;
-} walk_item;
+	walker    *w;
+	int       id;
+	deque     dq;
+	char      *dents;    // getdents64 buffer
+	char      *path;     // path buffer
+	size_t    path_cap;
+	pthread_t thread;
+	bool      started;
+} walk_worker;
+
+struct walker {
+	walk_func       fn;
+	int             nworkers;
+	walk_worker     *workers;
+	atomic_size_t   pending;
+	atomic_size_t   version;
+	atomic_int      nidle;
+	atomic_bool     done;
+	atomic_int      err; // first error returned by fn
+	atomic_int      read_err;      // first error reading a directory or entry
+	atomic_int      open_dirs;     // number of open walk_dirfd
+	atomic_int      max_open_dirs;
+	walk_dirfd      *dirfds;       // open walk_dirfd (guarded by dirfds_lock)
+	pthread_mutex_t dirfds_lock;
+	// Held for reading while a walk_dirfd's fd is used by a subdirectory
+	// and for writing when evicting them.
+	pthread_rwlock_t dirfds_evict_lock;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t  idle_cond;
+};
 
-static void walker_enqueue(walker *w, char *dir) {
-	if (!w->done) {
-		queue_push(w->enqueuec, dir);
+static void walker_wake_all(walker *w) {
+	pthread_mutex_lock(&w->idle_lock);
+	pthread_cond_broadcast(&w->idle_cond);
+	pthread_mutex_unlock(&w->idle_lock);
+}
+
+// walker_notify wakes idle workers after work was pushed.
+static void walker_notify(walker *w) {
+	atomic_fetch_add(&w->version, 1);
+	if (atomic_load(&w->nidle) > 0) {
+		walker_wake_all(w);
 	}
 }
 
-static char *walker_join_paths(const char *dir, size_t dlen, struct dirent *dp) {
-	size_t nlen = dp->d_namlen; // TODO: support systems without d_namlen
-	char *joined = malloc(dlen + strlen("/") + nlen + 1);
-	if (unlikely(!joined)) {
-		fprintf(stderr, "walker_join_paths: OOM\n");
-		assert(joined);
-		exit(1);
+// walker_stop stops the walk, err is the error to return (0 if the walk
+// completed).
+static void walker_stop(walker *w, int err) {
+	int zero = 0;
+	atomic_compare_exchange_strong(&w->err, &zero, err);
+	atomic_store(&w->done, true);
+	atomic_fetch_add(&w->version, 1);
+	walker_wake_all(w);
+}
+
+// walker_wait blocks until more work may be available. It returns false if
+// the walk is over.
+static bool walker_wait(walker *w, size_t seen) {
+	pthread_mutex_lock(&w->idle_lock);
+	atomic_fetch_add(&w->nidle, 1);
+	while (!atomic_load(&w->done) && atomic_load(&w->pending) > 0 &&
+	       atomic_load(&w->version) == seen) {
+		pthread_cond_wait(&w->idle_cond, &w->idle_lock);
+	}
+	atomic_fetch_sub(&w->nidle, 1);
+	pthread_mutex_unlock(&w->idle_lock);
+	return !atomic_load(&w->done) && atomic_load(&w->pending) > 0;
+}
+
+static void walker_enqueue(walk_worker *ww, walk_dir *dir) {
+	walker *w = ww->w;
+	atomic_fetch_add(&w->pending, 1);
+	deque_push_bottom(&ww->dq, dir);
+	walker_notify(w);
+}
+
+static walk_dir *walker_steal(walk_worker *ww) {
+	walker *w = ww->w;
+	for (int i = 1; i < w->nworkers; i++) {
+		walk_worker *victim = &w->workers[(ww->id + i) % w->nworkers];
+		walk_dir *dir = deque_steal_top(&victim->dq);
+		if (dir) {
+			return dir;
+		}
 	}
-	memcpy(joined, dir, dlen);
-	memcpy(&joined[dlen], "/", 1);
-	memcpy(&joined[dlen + 1], dp->d_name, nlen + 1);
-	return joined;
+	return NULL;
 }
 
-int walker_on_dirent(walker *w, const char *dir, size_t dlen, struct dirent *dp) {
-	char *joined = walker_join_paths(dir, dlen, dp);
-	if (dp->d_type == DT_DIR) {
-		walker_enqueue(w, joined);
+// walker_max_open_dirs returns the number of walk_dirfd that can be open
+// at once without running out of fds: each worker needs up to two fds for
+// the directory it reads (a DIR stream and its dup) and one to open a
+// subdirectory.
+static int walker_max_open_dirs(int nworkers) {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY) {
+		return WALKER_MAX_OPEN_DIRS;
+	}
+	rlim_t reserved = WALKER_RESERVED_FDS + 3 * (rlim_t)nworkers;
+	if (rl.rlim_cur <= reserved) {
 		return 0;
 	}
-	// TODO: support W_TRAVERSE_LINK
-	return w->fn(joined, dp->d_type);
+	rlim_t n = rl.rlim_cur - reserved;
+	return n < WALKER_MAX_OPEN_DIRS ? (int)n : WALKER_MAX_OPEN_DIRS;
 }
 
-int walker_do_walk(walker *w, const char *dirname) {
-	DIR *dir = opendir(dirname);
-	if (!dir) {
-		perror(dirname);
-		return 0; // TODO: check different error types
-	}
+// walker_error reports that path could not be read. The walk continues but
+// fails with the first such error once it completes.
+static void walker_error(walker *w, const char *path, int err) {
+	fprintf(stderr, "%s: %s\n", path, strerror(err));
+	int zero = 0;
+	atomic_compare_exchange_strong(&w->read_err, &zero, err);
+}
 
-	int ret = 0;
-	struct dirent *dp;
-	const size_t dirlen = strlen(dirname);
-	bool skip_files = false;
+// walker_retain_dir returns a walk_dirfd for the directory open as fd that
+// can be shared with its subdirectories or NULL if too many directories are
+// already open. The caller holds the first reference and must call
+// walker_reader_done once it stops reading fd.
+static walk_dirfd *walker_retain_dir(walker *w, int fd) {
+	if (atomic_fetch_add(&w->open_dirs, 1) >= atomic_load(&w->max_open_dirs)) {
+		atomic_fetch_sub(&w->open_dirs, 1);
+		return NULL;
+	}
+	walk_dirfd *df = malloc(sizeof(walk_dirfd));
+	if (df) {
+#ifdef WALKER_USE_GETDENTS
+		df->fd = fd;
+#else
+		df->fd = dup(fd); // fd is owned by the DIR stream
+#endif
+		atomic_init(&df->refs, 1);
+		df->reading = true;
+		df->prev = NULL;
+	}
+	if (!df || df->fd == -1) {
+		free(df);
+		atomic_fetch_sub(&w->open_dirs, 1);
+		return NULL;
+	}
+	pthread_mutex_lock(&w->dirfds_lock);
+	df->next = w->dirfds;
+	if (w->dirfds) {
+		w->dirfds->prev = df;
+	}
+	w->dirfds = df;
+	pthread_mutex_unlock(&w->dirfds_lock);
+	return df;
+}
 
-	while ((dp = readdir(dir))) {
-		if (dp->d_type == DT_UNKNOWN) {
-			continue;
-		}
-		if (skip_files && dp->d_type == DT_REG) {
-			continue;
-		}
-		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
-			continue;
-		}
-		ret = walker_on_dirent(w, dirname, dirlen, dp);
-		if (ret != 0) {
-			if (ret == W_SKIP_FILES) {
-				skip_files = true;
-				ret = 0;
-				continue;
-			}
-			break;
-		}
+static void walker_release_dir(walker *w, walk_dirfd *df) {
+	if (!df || atomic_fetch_sub(&df->refs, 1) != 1) {
+		return;
+	}
+	pthread_mutex_lock(&w->dirfds_lock);
+	if (df->prev) {
+		df->prev->next = df->next;
+	} else {
+		w->dirfds = df->next;
 	}
+	if (df->next) {
+		df->next->prev = df->prev;
+	}
+	const int fd = df->fd;
+	pthread_mutex_unlock(&w->dirfds_lock);
+	if (fd != -1) {
+		close(fd);
+		atomic_fetch_sub(&w->open_dirs, 1);
+	}
+	free(df);
+}
 
-	closedir(dir);
-	return ret;
+// walker_reader_done releases the reader's reference to df, after which
+// its fd may be evicted.
+static void walker_reader_done(walker *w, walk_dirfd *df) {
+	if (df) {
+		pthread_mutex_lock(&w->dirfds_lock);
+		df->reading = false;
+		pthread_mutex_unlock(&w->dirfds_lock);
+		walker_release_dir(w, df);
+	}
 }
 
-void *walker_do_work(void *data) {
-	assert(data);
-	walker *w = (walker *)data;
-	while (!w->done) {
-		char *dir = (char *)queue_pop_wait(w->workc);
-		if (!dir || w->done) {
-			break;
+// walker_evict_dirs closes the fds of all walk_dirfd that are not being
+// read and halves the number that may be kept open. It returns the number
+// of fds closed.
+static int walker_evict_dirs(walker *w) {
+	int n = 0;
+	pthread_rwlock_wrlock(&w->dirfds_evict_lock);
+	pthread_mutex_lock(&w->dirfds_lock);
+	for (walk_dirfd *df = w->dirfds; df; df = df->next) {
+		if (!df->reading && df->fd != -1) {
+			close(df->fd);
+			df->fd = -1;
+			n++;
 		}
-		int ret = walker_do_walk(w, dir);
-		(void)ret; // WARN: handle this
-
-		// WARN WARN
-		// use a union or something for the return value
-		// WARN WARN
+	}
+	pthread_mutex_unlock(&w->dirfds_lock);
+	pthread_rwlock_unlock(&w->dirfds_evict_lock);
+	atomic_fetch_sub(&w->open_dirs, n);
+	atomic_store(&w->max_open_dirs, atomic_load(&w->open_dirs) / 2);
+	return n;
+}
 
-		if (dir) {
-			free(dir);
+static int walker_try_open_dir(walker *w, walk_dir *dir) {
+	const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	int fd = -1;
+	if (dir->parent) {
+		pthread_rwlock_rdlock(&w->dirfds_evict_lock);
+		if (dir->parent->fd != -1) {
+			fd = openat(dir->parent->fd, &dir->path[dir->name_off], flags);
+			pthread_rwlock_unlock(&w->dirfds_evict_lock);
+			return fd;
 		}
-	};
-	return NULL;
+		pthread_rwlock_unlock(&w->dirfds_evict_lock);
+	}
+	return open(dir->path, flags);
 }
 
-int walker_walk(const char *root) {
-	const int nprocs = 12; // TODO: don't hard code this
-	(void)root;   // WARN
-	(void)nprocs; // WARN
+// walker_open_dir opens dir relative to its parent (if any) and releases
+// the parent.
+static int walker_open_dir(walker *w, walk_dir *dir) {
+	int fd = walker_try_open_dir(w, dir);
+	if (fd == -1 && (errno == EMFILE || errno == ENFILE) && walker_evict_dirs(w) > 0) {
+		fd = walker_try_open_dir(w, dir);
+	}
+	if (dir->parent) {
+		int err = errno;
+		walker_release_dir(w, dir->parent);
+		dir->parent = NULL;
+		errno = err;
+	}
+	if (fd == -1) {
+		int err = errno;
+		walker_error(w, dir->path, err);
+		errno = err;
+	}
+	return fd;
+}
 
-	walker *w = malloc(sizeof(walker));
-	if (!w) {
-		fprintf(stderr, "error: OOM\n");
-		assert(0);
-		return 1;
+// walker_path_reserve grows the path buffer of ww to hold size bytes.
+static void walker_path_reserve(walk_worker *ww, size_t size) {
+	if (likely(size <= ww->path_cap)) {
+		return;
 	}
-	w->workc = malloc(sizeof(queue));
-	w->enqueuec = malloc(sizeof(queue));
-	if (!w->workc || !w->enqueuec) {
-		fprintf(stderr, "error: OOM\n");
-		assert(0);
-		return 1;
-	}
-
-	int ret;
-	if ((ret = queue_init(w->workc)) != 0) {
-		fprintf(stderr, "error: failed to initialize: workc: %d\n", ret);
-		assert(0);
-		return ret;
+	size_t cap = ww->path_cap * 2;
+	while (cap < size) {
+		cap *= 2;
 	}
-	if ((ret = queue_init(w->enqueuec)) != 0) {
-		fprintf(stderr, "error: failed to initialize: enqueuec: %d\n", ret);
-		assert(0);
-		return ret;
+	char *path = realloc(ww->path, cap);
+	if (unlikely(!path)) {
+		fprintf(stderr, "walker_path_reserve: OOM\n");
+		assert(path);
+		exit(1);
 	}
+	ww->path = path;
+	ww->path_cap = cap;
+}
 
-	pthread_t *threads = calloc(nprocs, sizeof(pthread_t));
+// walk_reader is the state of the directory being read by a worker.
+typedef struct {
+	walk_worker *ww;
+	walk_dir    *dir;
+	int         fd;
+	walk_dirfd  *shared; // fd shared with subdirectories (if any)
+	bool        no_share;
+	size_t      dlen;    // length of the directory path in ww->path
+	bool        skip_files;
+} walk_reader;
+
+// walker_push_dir enqueues the directory whose path is in the worker's
+// path buffer, sharing the fd of the directory being read with it.
+static void walker_push_dir(walk_reader *r, size_t len, size_t name_off) {
+	walker *w = r->ww->w;
+	if (!r->shared && !r->no_share) {
+		r->shared = walker_retain_dir(w, r->fd);
+		r->no_share = !r->shared;
+	}
+	if (r->shared) {
+		atomic_fetch_add(&r->shared->refs, 1);
+	}
+	walker_enqueue(r->ww, walk_dir_new(r->shared, r->dir, r->ww->path, len, name_off));
+}
 
-	for (int i = 0; i < nprocs; i++) {
-		if ((ret = pthread_create(&threads[i], NULL, walker_do_work, w)) != 0) {
-			assert(ret == 0);
-			goto err_cleanup;
+// walker_is_ancestor returns if (dev, ino) is the directory being read or
+// one of its ancestors.
+static bool walker_is_ancestor(walk_reader *r, dev_t dev, ino_t ino) {
+	for (walk_dir *d = r->dir; d; d = d->up) {
+		if (d->has_id && d->dev == dev && d->ino == ino) {
+			return true;
 		}
 	}
+	return false;
+}
 
-err_cleanup:
-	queue_close(w->workc);
-	queue_close(w->enqueuec);
+// walker_path_append appends "/name" to the directory path in the worker's
+// path buffer and returns the length of the path. The name starts at dlen +
+// the returned *slash.
+static size_t walker_path_append(walk_reader *r, const char *name, size_t nlen, bool *slash) {
+	walk_worker *ww = r->ww;
+	size_t dlen = r->dlen;
+	*slash = dlen > 0 && ww->path[dlen - 1] != '/';
+	size_t len = dlen + *slash + nlen;
+	walker_path_reserve(ww, len + 1);
+	ww->path[dlen] = '/';
+	memcpy(&ww->path[dlen + *slash], name, nlen + 1);
+	return len;
+}
 
-	for (int i = 0; i < nprocs; i++) {
-		if (!threads[i]) {
-			continue;
+static int walker_on_dirent(walk_reader *r, const char *name, size_t nlen, int typ) {
+	walk_worker *ww = r->ww;
+	walker *w = ww->w;
+
+	size_t dlen = r->dlen;
+	bool slash;
+	size_t len = walker_path_append(r, name, nlen, &slash);
+
+	const char *ename = &ww->path[dlen + slash];
+	int ret = w->fn(r->fd, ename, ww->path, typ);
+	if (typ == DT_DIR && ret == 0) {
+		walker_push_dir(r, len, dlen + slash);
+	} else if (typ == DT_LNK && ret == W_TRAVERSE_LINK) {
+		// Walk the link's target if it is a directory that is not an
+		// ancestor of the link.
+		struct stat st;
+		if (fstatat(r->fd, ename, &st, 0) == 0 && S_ISDIR(st.st_mode) &&
+		    !walker_is_ancestor(r, st.st_dev, st.st_ino)) {
+			walker_push_dir(r, len, dlen + slash);
 		}
-		pthread_cancel(threads[i]);
 	}
-	free(threads);
-	free(w->workc);
-	free(w->enqueuec);
-	free(w);
+	ww->path[dlen] = '\0';
+	return (ret == W_SKIP_DIR || ret == W_TRAVERSE_LINK) ? 0 : ret;
+}
 
-	return 1;
+static int walker_mode_type(mode_t mode) {
+	switch (mode & S_IFMT) {
+	case S_IFREG:  return DT_REG;
+	case S_IFDIR:  return DT_DIR;
+	case S_IFLNK:  return DT_LNK;
+	case S_IFIFO:  return DT_FIFO;
+	case S_IFSOCK: return DT_SOCK;
+	case S_IFCHR:  return DT_CHR;
+	case S_IFBLK:  return DT_BLK;
+	default:       return DT_UNKNOWN;
+	}
 }
 
-typedef struct {
-	int id;
-	queue *q;
-	char *val;
-	atomic_int *count;
-} thread_arg;
-
-void *thread_test(void *p) {
-	thread_arg *a = p;
-	printf("%d: len (start): %zu\n", a->id, queue_len(a->q));
-	for (int i = 0; i < 100000; i++) {
-		if (i&1) {
-			queue_pop(a->q);
-			// queue_pop_wait(a->q);
-			atomic_fetch_add(a->count, -1);
-		} else {
-			queue_push(a->q, a->val);
-			atomic_fetch_add(a->count, 1);
+// walker_visit handles a single directory entry and returns non-zero to
+// stop reading the directory.
+static int walker_visit(walk_reader *r, const char *name, size_t nlen, int typ) {
+	if (name[0] == '.' && (nlen == 1 || (nlen == 2 && name[1] == '.'))) {
+		return 0;
+	}
+	if (unlikely(typ == DT_UNKNOWN)) {
+		struct stat st;
+		if (fstatat(r->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			// Removed since it was read or not accessible
+			int err = errno;
+			bool slash;
+			walker_path_append(r, name, nlen, &slash);
+			walker_error(r->ww->w, r->ww->path, err);
+			r->ww->path[r->dlen] = '\0';
+			return 0;
 		}
+		typ = walker_mode_type(st.st_mode);
 	}
-	queue_push(a->q, a->val);
-	atomic_fetch_add(a->count, 1);
-	printf("%d: len (end): %zu - %d\n", a->id, queue_len(a->q), atomic_load(a->count));
-	return NULL;
+	if (r->skip_files && typ == DT_REG) {
+		return 0;
+	}
+	int ret = walker_on_dirent(r, name, nlen, typ);
+	if (ret == W_SKIP_FILES) {
+		r->skip_files = true;
+		ret = 0;
+	}
+	return ret;
 }
 
-void *drain_queue(void *p) {
-	queue *q = (queue *)p;
-	for (;;) {
-		if (queue_pop_wait(q) == NULL && queue_is_closed(q)) {
+// walker_reader_init copies the path of dir to the worker's path buffer.
+static void walker_reader_init(walk_reader *r, walk_worker *ww, walk_dir *dir, int fd) {
+	*r = (walk_reader){ .ww = ww, .dir = dir, .fd = fd, .dlen = dir->len };
+	// Record the id of the directory for walker_is_ancestor. This must
+	// happen before any subdirectory (which may read it) is queued.
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		dir->dev = st.st_dev;
+		dir->ino = st.st_ino;
+		dir->has_id = true;
+	}
+	walker_path_reserve(ww, dir->len + 1);
+	memcpy(ww->path, dir->path, dir->len + 1);
+}
+
+#ifdef WALKER_USE_GETDENTS
+
+// Linux: read directories with getdents64 into the worker's buffer and
+// parse the records in place, instead of going through readdir which
+// returns one entry per call from a small buffer.
+
+struct linux_dirent64 {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+
+int walker_do_walk(walk_worker *ww, walk_dir *dir) {
+	int fd = walker_open_dir(ww->w, dir);
+	if (fd == -1) {
+		// The walk fails if the root cannot be read
+		return dir->root ? errno : 0; // TODO: check different error types
+	}
+
+	int ret = 0;
+	walk_reader r;
+	walker_reader_init(&r, ww, dir, fd);
+
+	while (ret == 0 && !atomic_load(&ww->w->done)) {
+		long n = syscall(SYS_getdents64, fd, ww->dents, WALKER_DENTS_SIZE);
+		if (n <= 0) {
+			if (n == -1) {
+				walker_error(ww->w, dir->path, errno);
+			}
 			break;
 		}
+		for (long off = 0; off < n; ) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(void *)&ww->dents[off];
+			off += d->d_reclen;
+			ret = walker_visit(&r, d->d_name, strlen(d->d_name), d->d_type);
+			if (ret != 0) {
+				break;
+			}
+		}
 	}
-	printf("### EXIT\n");
-	return NULL;
+
+	// The fd is closed by the last subdirectory to use it
+	if (r.shared) {
+		walker_reader_done(ww->w, r.shared);
+	} else {
+		close(fd);
+	}
+	return ret;
 }
 
-queue *global_queue = NULL;
-atomic_size_t global_count = 0;
+#else
 
-int count_lines(const unsigned char *s, int size) {
-	int n = 0;
-	for (int i = 0; i < size; i++) {
-		if (s[i] == '\n') {
-			n++;
-		}
+int walker_do_walk(walk_worker *ww, walk_dir *dir) {
+	int fd = walker_open_dir(ww->w, dir);
+	if (fd == -1) {
+		// The walk fails if the root cannot be read
+		return dir->root ? errno : 0; // TODO: check different error types
 	}
-	return n;
+	DIR *dp = fdopendir(fd);
+	if (!dp) {
+		int err = errno;
+		walker_error(ww->w, dir->path, err);
+		close(fd);
+		return dir->root ? err : 0;
+	}
+
+	int ret = 0;
+	walk_reader r;
+	walker_reader_init(&r, ww, dir, fd);
+
+	struct dirent *ent;
+	errno = 0; // readdir returns NULL at the end and on error
+	while (ret == 0 && (ent = readdir(dp)) && !atomic_load(&ww->w->done)) {
+#ifdef _DIRENT_HAVE_D_NAMLEN
+		size_t nlen = ent->d_namlen;
+#else
+		size_t nlen = strlen(ent->d_name);
+#endif
+		ret = walker_visit(&r, ent->d_name, nlen, ent->d_type);
+		errno = 0;
+	}
+	if (ret == 0 && !ent && errno != 0) {
+		walker_error(ww->w, dir->path, errno);
+	}
+
+	closedir(dp);
+	walker_reader_done(ww->w, r.shared);
+	return ret;
 }
 
-void *ftw_worker(void *p) {
-	(void)p;
-	const int size = 1024 * 1024;
-	unsigned char *buffer = malloc(size);
-	for (;;) {
-		char *path = (char *)queue_pop_wait(global_queue);
-		if (!path) {
-			if (queue_is_closed(global_queue)) {
+#endif /* WALKER_USE_GETDENTS */
+
+void *walker_do_work(void *data) {
+	assert(data);
+	walk_worker *ww = (walk_worker *)data;
+	walker *w = ww->w;
+	while (!atomic_load(&w->done)) {
+		size_t seen = atomic_load(&w->version);
+		walk_dir *dir = deque_pop_bottom(&ww->dq);
+		if (!dir) {
+			dir = walker_steal(ww);
+		}
+		if (!dir) {
+			if (!walker_wait(w, seen)) {
 				break;
 			}
 			continue;
 		}
-		FILE *fp = fopen(path, "r");
-		if (!fp) {
-			continue;
-		}
-		int n;
-		int count = 0;
-		while ((n = fread(buffer, 1, size, fp)) == size) {
-			count += count_lines(buffer, n);
+		int ret = walker_do_walk(ww, dir);
+		walk_dir_release(dir);
+		if (ret != 0) {
+			walker_stop(w, ret);
+			break;
 		}
-		if (n > 0) {
-			// TODO: check error
-			count += count_lines(buffer, n);
+		if (atomic_fetch_sub(&w->pending, 1) == 1) {
+			walker_stop(w, 0); // the whole tree has been read
+			break;
 		}
-		fclose(fp);
-		free(path);
-		global_count += count;
-	}
+	};
 	return NULL;
 }
 
-// int (*fn)(const char *, const struct stat *ptr, int flag)
-int walk_ftw(const char *name, const struct stat *ptr, int flag) {
-	(void)ptr;
-	(void)flag;
-	if (flag == FTW_F) {
-		queue_push(global_queue, strdup(name));
-	}
-	return 0;
+static int walker_default_threads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
 }
 
-int test_dirent() {
-	const char *dirname = "/Users/cvieth/Projects/C/utils/fastwalk";
-	DIR *dir = opendir(dirname);
-	if (!dir) {
-		perror(dirname);
-		return 1; // TODO: check different error types
+// walker_walk walks the directory tree rooted at root calling fn for each
+// entry using nthreads worker threads (the number of online CPUs if less
+// than 1). It returns 0, the first error returned by fn or an errno value if
+// root could not be opened. Directories and entries that cannot be read are
+// reported on stderr and skipped; the walk then returns the first errno.
+int walker_walk(const char *root, walk_func fn, int nthreads) {
+	if (nthreads < 1) {
+		nthreads = walker_default_threads();
 	}
 
-	struct dirent *dp;
-	while ((dp = readdir(dir))) {
-		// TODO: support "skip files"
-		printf("%s (%d): %i %zu\n", dp->d_name, dp->d_type, dp->d_namlen, strlen(dp->d_name));
-		char *s = walker_join_paths(dirname, strlen(dirname), dp);
-		printf("\t'%s'\n", s);
-		free(s);
+	walker *w = calloc(1, sizeof(walker));
+	if (!w) {
+		fprintf(stderr, "error: OOM\n");
+		assert(0);
+		return 1;
 	}
+	w->fn = fn;
+	w->nworkers = nthreads;
+	atomic_init(&w->max_open_dirs, walker_max_open_dirs(nthreads));
+	pthread_mutex_init(&w->idle_lock, NULL);
+	pthread_cond_init(&w->idle_cond, NULL);
+	pthread_mutex_init(&w->dirfds_lock, NULL);
+	pthread_rwlock_init(&w->dirfds_evict_lock, NULL);
 
-	closedir(dir);
-	return 0;
-}
-
-int main(int argc, char const *argv[]) {
-	(void)argc;
-	(void)argv;
-	// assert(test_dirent() == 0);
-	// return 0;
-
-	global_queue = malloc(sizeof(queue));
-	assert(queue_init(global_queue) == 0);
+	int ret = 0;
+	int ninit = 0;
+	w->workers = calloc(nthreads, sizeof(walk_worker));
+	if (!w->workers) {
+		fprintf(stderr, "error: OOM\n");
+		ret = ENOMEM;
+		goto cleanup;
+	}
+	for ( ; ninit < nthreads; ninit++) {
+		walk_worker *ww = &w->workers[ninit];
+		ww->w = w;
+		ww->id = ninit;
+		if ((ret = deque_init(&ww->dq)) != 0) {
+			fprintf(stderr, "error: failed to initialize deque: %d\n", ret);
+			goto cleanup;
+		}
+#ifdef WALKER_USE_GETDENTS
+		ww->dents = malloc(WALKER_DENTS_SIZE);
+		if (!ww->dents) {
+			fprintf(stderr, "error: OOM\n");
+			deque_free(&ww->dq);
+			ret = ENOMEM;
+			goto cleanup;
+		}
+#endif
+		ww->path = malloc(WALKER_PATH_INITIAL_CAP);
+		if (!ww->path) {
+			fprintf(stderr, "error: OOM\n");
+			deque_free(&ww->dq);
+			free(ww->dents);
+			ret = ENOMEM;
+			goto cleanup;
+		}
+		ww->path_cap = WALKER_PATH_INITIAL_CAP;
+	}
 
-	const int thread_count = 4;
-	pthread_t threads[thread_count];
+	walk_dir *dir = walk_dir_new(NULL, NULL, root, strlen(root), 0);
+	dir->root = true;
+	atomic_store(&w->pending, 1);
+	deque_push_bottom(&w->workers[0].dq, dir);
 
-	for (int i = 0; i < thread_count; i++) {
-		int res = pthread_create(&threads[i], NULL, ftw_worker, global_queue);
-		assert(res == 0);
+	int started = 0;
+	for (int i = 0; i < nthreads; i++) {
+		walk_worker *ww = &w->workers[i];
+		ww->started = pthread_create(&ww->thread, NULL, walker_do_work, ww) == 0;
+		started += ww->started;
 	}
-	int ret = ftw("/Users/cvieth/Projects/C", walk_ftw, 10000);
-	printf("RET: %d\n", ret);
-	queue_close(global_queue);
-
-	for (int i = 0; i < thread_count; i++) {
-		assert(pthread_join(threads[i], NULL) == 0);
+	// Workers steal from every deque so the walk completes as long as
+	// at least one worker started.
+	if (started == 0) {
+		walker_do_work(&w->workers[0]);
+	}
+	for (int i = 0; i < nthreads; i++) {
+		if (w->workers[i].started) {
+			pthread_join(w->workers[i].thread, NULL);
+		}
+	}
+	ret = atomic_load(&w->err);
+	if (ret == 0) {
+		ret = atomic_load(&w->read_err);
 	}
-	printf("LINES: %zu\n", global_count);
-	printf("DONE\n");
 
-	return 0;
+cleanup:
+	for (int i = 0; i < ninit; i++) {
+		// Directories left over when the walk was stopped early
+		walk_dir *d;
+		while ((d = deque_pop_bottom(&w->workers[i].dq))) {
+			walker_release_dir(w, d->parent);
+			walk_dir_release(d);
+		}
+		deque_free(&w->workers[i].dq);
+		free(w->workers[i].dents);
+		free(w->workers[i].path);
+	}
+	free(w->workers);
+	pthread_rwlock_destroy(&w->dirfds_evict_lock);
+	pthread_mutex_destroy(&w->dirfds_lock);
+	pthread_cond_destroy(&w->idle_cond);
+	pthread_mutex_destroy(&w->idle_lock);
+	free(w);
+	return ret;
 }
 
-/*
-int xmain(int argc, char const *argv[]) {
-	(void)argc;
-	(void)argv;
-
-	queue *q = malloc(sizeof(queue));
-	int res = queue_init(q);
-	assert(res == 0);
-
-	const int thread_count = 4;
-	pthread_t threads[thread_count];
-	atomic_int count = 0;
-	thread_arg thread_args[] = {
-		{0, q, "a", &count},
-		{1, q, "b", &count},
-		{2, q, "c", &count},
-		{3, q, "d", &count},
-		// {4, q, "d", &count},
-		// {5, q, "d", &count},
-		// {6, q, "d", &count},
-		// {7, q, "d", &count},
-	};
-	assert(sizeof(thread_args) / sizeof(thread_args[0]) == thread_count);
-
-	pthread_t xthread;
-	pthread_create(&xthread, NULL, drain_queue, q);
+// follow_links makes print_path traverse symbolic links to directories
+static bool follow_links = false;
 
-	for (int i = 0; i < thread_count; i++) {
-		res = pthread_create(&threads[i], NULL, thread_test, &thread_args[i]);
-		assert(res == 0);
-	}
-	for (int i = 0; i < thread_count; i++) {
-		res = pthread_join(threads[i], NULL);
-		assert(res == 0);
-		printf("%d: joined\n", thread_args[i].id);
-	}
-	printf("\n");
-
-	printf("killing drain\n");
-	printf("queue_close: %d\n", queue_close(q));
-	// queue_close(q);
-	pthread_join(xthread, NULL);
-	printf("kill complete\n");
+// print_path prints path on its own line, the whole line is written by a
+// single call so that lines printed by concurrent workers never interleave.
+static int print_path(int dirfd, const char *name, const char *path, int typ) {
+	(void)dirfd;
+	(void)name;
+	printf("%s\n", path);
+	return (follow_links && typ == DT_LNK) ? W_TRAVERSE_LINK : 0;
+}
 
-	queue_node *head = q->head;
-	queue_node *tail = q->tail;
-	printf("count: %d\n", count);
-	printf("head: %p\n", (void *)head);
-	printf("tail: %p\n", (void *)tail);
-	printf("len: %zu\n", queue_len(q));
-	printf("closed: %d\n", q->closed);
+static int usage(const char *msg, const char *arg) {
+	fprintf(stderr, "error: %s: '%s'\n", msg, arg);
+	fprintf(stderr, "usage: fastwalk [-L] [-j N] [DIR]\n");
+	return 2;
+}
 
-	int n = 0;
-	while (queue_len(q) > 0) {
-		printf("%d: pop (%zu): %s\n", n++, queue_len(q), (char *)queue_pop(q));
-		if (n >= 20) {
-			printf("error N: %d\n", n);
-			return 1;
+int main(int argc, char const *argv[]) {
+	int nthreads = 0;
+	const char *root = NULL;
+	bool options = true;
+	for (int i = 1; i < argc; i++) {
+		if (!options || argv[i][0] != '-' || argv[i][1] == '\0') {
+			if (root) {
+				return usage("unexpected argument", argv[i]);
+			}
+			root = argv[i];
+		} else if (strcmp(argv[i], "--") == 0) {
+			options = false;
+		} else if (strcmp(argv[i], "-j") == 0) {
+			if (i + 1 == argc) {
+				return usage("missing argument", argv[i]);
+			}
+			char *end;
+			const char *arg = argv[++i];
+			long n = strtol(arg, &end, 10);
+			if (end == arg || *end != '\0' || n < 1 || n > 1024) {
+				fprintf(stderr, "error: invalid number of threads: '%s'\n", arg);
+				return 1;
+			}
+			nthreads = (int)n;
+		} else if (strcmp(argv[i], "-L") == 0) {
+			follow_links = true;
+		} else {
+			return usage("unknown option", argv[i]);
 		}
 	}
-
-	// queue_push(q, "a");
-	// queue_push(q, "b");
-	// queue_push(q, "c");
-	// printf("len: %zu\n", queue_len(q));
-	// printf("len: %s\n", (char *)queue_pop(q));
-	// printf("len: %s\n", (char *)queue_pop(q));
-	// printf("len: %s\n", (char *)queue_pop(q));
-	// printf("len: %zu\n", queue_len(q));
-	// printf("Ok\n");
-
-	// queue q;
-	// int res = queue_init(&q);
-	// assert(res == 0);
-	// queue_push(&q, "a");
-	// queue_push(&q, "b");
-	// queue_push(&q, "c");
-	// printf("len: %zu\n", queue_len(&q));
-	// printf("len: %s\n", (char *)queue_pop(&q));
-	// printf("len: %s\n", (char *)queue_pop(&q));
-	// printf("len: %s\n", (char *)queue_pop(&q));
-	// printf("len: %zu\n", queue_len(&q));
-	// printf("Ok\n");
-
-	return 0;
+	return walker_walk(root ? root : ".", print_path, nthreads) != 0;
 }
-*/
@@ -0,0 +1,85 @@
+#ifndef CSI_H
+#define CSI_H
+
+// CSI escape sequence stripping.
+//
+// This header is self-contained (like hedley.h) so that it can be copied
+// into the other ANSI filters (cfd, strip-ansi) that want the same engine.
+//
+// Only CSI sequences are matched: `\x1b\[[0-?]*[ -/]*[@-~]`. All other
+// bytes, including an ESC that does not start a CSI sequence, are kept.
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+// CSI_MORE is returned by csi_match when more input is needed to decide if
+// there is a CSI sequence at the end of the input.
+#define CSI_MORE ((ptrdiff_t)-1)
+
+// csi_match returns the length of the CSI sequence at p (p[0] must be an
+// ESC), 0 if there is none or CSI_MORE if the input ends before it could be
+// decided and eof is false.
+static inline ptrdiff_t csi_match(const unsigned char *p, size_t n, bool eof) {
+	if (n < 2) {
+		return eof ? 0 : CSI_MORE;
+	}
+	if (p[1] != '[') {
+		return 0;
+	}
+	size_t i = 2;
+	// parameter bytes
+	for ( ; i < n && (unsigned char)(p[i]-'0') <= '?'-'0'; i++) {
+	}
+	// intermediate bytes
+	for ( ; i < n && (unsigned char)(p[i]-' ') <= '/'-' '; i++) {
+	}
+	if (i == n) {
+		return eof ? 0 : CSI_MORE;
+	}
+	// final byte
+	if ((unsigned char)(p[i]-'@') <= '~'-'@') {
+		return i + 1;
+	}
+	return 0;
+}
+
+// csi_strip copies src to dst with all CSI sequences removed and returns
+// the number of bytes written to dst. The number of bytes of src consumed
+// is stored in used: unless eof is true an incomplete sequence at the end
+// of src is not consumed and must be passed again followed by more input.
+//
+// dst may be src (the input is stripped in place) and is never written past
+// the bytes already consumed. The next ESC is found with memchr, which is
+// vectorized by libc, so escape-free input is moved at memcpy speed and
+// not at all when stripping in place.
+static inline size_t csi_strip(char *dst, const char *src, size_t n, bool eof,
+                               size_t *used) {
+	size_t w = 0;
+	size_t i = 0;
+	for (;;) {
+		const char *esc = memchr(&src[i], '\x1b', n - i);
+		size_t j = esc ? (size_t)(esc - src) : n;
+		if (&dst[w] != &src[i]) {
+			memmove(&dst[w], &src[i], j - i);
+		}
+		w += j - i;
+		i = j;
+		if (i == n) {
+			break;
+		}
+		ptrdiff_t m = csi_match((const unsigned char *)&src[i], n - i, eof);
+		if (m == CSI_MORE) {
+			break;
+		}
+		if (m == 0) {
+			dst[w++] = src[i++]; // not a CSI sequence: keep the ESC
+			continue;
+		}
+		i += m;
+	}
+	*used = i;
+	return w;
+}
+
+#endif /* CSI_H */
@@ -2,7 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "csi.h"
 
 #ifndef likely
 #define likely(x)   __builtin_expect(!!(x), 1)
@@ -11,71 +15,94 @@
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #endif
 
-// static const int NC_ALIGNMENT = 4096;
-
-/*
-typedef struct {
-	int start;
-	int end;
-} match;
-
-match find_index(const char *b, int len) {
-	// Pattern: \x1b\[[0-?]*[ -/]*[@-~]
-	static const int min_len = 2; // "\\[[@-~]"
+#define PROGRAM_NAME "nocolor"
 
-	match m = { .start = -1, .end = -1 };
+// Input is read and stripped in place in chunks of NC_BUFFER_SIZE bytes so
+// memory use is constant. An incomplete CSI sequence at the end of a chunk
+// is moved to the front of the buffer and completed by the next read, and
+// sequences longer than the buffer are not stripped.
+#ifndef NC_BUFFER_SIZE
+#define NC_BUFFER_SIZE (128 * 1024)
+#endif
 
-	return m;
+static ssize_t read_full(int fd, char *buf, size_t size) {
+	ssize_t n;
+	do {
+		n = read(fd, buf, size);
+	} while (n == -1 && errno == EINTR);
+	return n;
 }
-*/
 
-int main() {
+static int write_full(int fd, const char *buf, size_t size) {
+	while (size > 0) {
+		ssize_t n = write(fd, buf, size);
+		if (unlikely(n == -1)) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		size -= n;
+	}
 	return 0;
 }
 
-/*
-func findIndex(b []byte) (int, int) {
-	// Pattern: \x1b\[[0-?]*[ -/]*[@-~]
-	const minLen = 2 // "\\[[@-~]"
+static int nocolor(int fd_in, int fd_out, char *buf) {
+	size_t len = 0;
+	bool eof = false;
+	while (!eof) {
+		// If an incomplete sequence fills the buffer strip it as-is
+		bool full = len == NC_BUFFER_SIZE;
+		if (likely(!full)) {
+			ssize_t n = read_full(fd_in, &buf[len], NC_BUFFER_SIZE - len);
+			if (n == -1) {
+				perror(PROGRAM_NAME": read");
+				return 1;
+			}
+			len += n;
+			eof = n == 0;
+		}
 
-	start := bytes.IndexByte(b, '\x1b')
-	if start == -1 || len(b)-start < minLen || b[start+1]-'@' > '_'-'@' {
-		return -1, -1
+		size_t used;
+		size_t out = csi_strip(buf, buf, len, eof || full, &used);
+		if (write_full(fd_out, buf, out) == -1) {
+			perror(PROGRAM_NAME": write");
+			return 1;
+		}
+		// Keep the incomplete sequence (if any) for the next read
+		len -= used;
+		memmove(buf, &buf[used], len);
 	}
+	return 0;
+}
 
-	n := start + 2 // ESC + second byte [@-_]
-
-	// parameter bytes
-	for ; n < len(b) && b[n]-'0' <= '?'-'0'; n++ {
-	}
-	// intermediate bytes
-	for ; n < len(b) && b[n]-' ' <= '/'-' '; n++ {
-	}
-	// final byte
-	if n < len(b) && b[n]-'@' <= '~'-'@' {
-		return start, n + 1
+int main(int argc, char const *argv[]) {
+	char *buf = malloc(NC_BUFFER_SIZE);
+	if (!buf) {
+		perror(PROGRAM_NAME": malloc");
+		return 1;
 	}
-	return -1, -1
-}
 
-func (c *NoColor) Strip(b []byte) []byte {
-	c.buf = c.buf[:0]
-	for {
-		start, end := findIndex(b)
-		if start == -1 {
-			break
-		}
-		if start > 0 {
-			c.buf = append(c.buf, b[:start]...)
+	int rc = 0;
+	if (argc <= 1) {
+		rc = nocolor(STDIN_FILENO, STDOUT_FILENO, buf);
+	}
+	for (int i = 1; i < argc && rc == 0; i++) {
+		if (strcmp(argv[i], "-") == 0) {
+			rc = nocolor(STDIN_FILENO, STDOUT_FILENO, buf);
+			continue;
 		}
-		if end < len(b) {
-			b = b[end:]
-		} else {
-			b = nil
-			break
+		int fd = open(argv[i], O_RDONLY);
+		if (fd == -1) {
+			fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, argv[i], strerror(errno));
+			rc = 1;
+			break;
 		}
+		rc = nocolor(fd, STDOUT_FILENO, buf);
+		close(fd);
 	}
-	c.buf = append(c.buf, b...)
-	return c.buf
+
+	free(buf);
+	return rc;
 }
-*/
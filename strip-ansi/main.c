@@ -7,85 +7,24 @@
 #include <stdint.h>
 #include <errno.h>
 #include <stdbool.h>
-#include <locale.h>
-#include <wchar.h>
-#include <assert.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 
-#include "hedley.h"
-
-// Simple buffer implementation
-
-struct buffer {
-	char   *buf;
-	size_t cap;
-	size_t len;
-};
-
-HEDLEY_NON_NULL(1)
-static void buffer_reset(struct buffer *b) {
-	b->cap = 0;
-	b->len = 0;
-}
-
-HEDLEY_NON_NULL(1)
-static void buffer_free(struct buffer *b) {
-	free(b->buf);
-	b->buf = NULL;
-	buffer_reset(b);
-}
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-HEDLEY_NON_NULL(1)
-static int buffer_grow(struct buffer *b, size_t len) {
-	if (len > b->cap-b->len) {
-		size_t cap = (b->cap*2) + len;
-		char *buf = realloc(b->buf, cap);
-		assert(buf);
-		if (!buf) {
-			buffer_free(b);
-			return -1;
-		}
-		b->buf = buf;
-		b->cap = cap;
-	}
-	return 0;
-}
-
-HEDLEY_NON_NULL(1, 2)
-static int buffer_write(struct buffer *b, const void *buf, size_t len) {
-	if (buffer_grow(b, len) == -1) {
-		return -1;
-	}
-	memcpy(&b->buf[b->len], buf, len);
-	b->len += len;
-	return 0;
-}
-
-/*
-static int buffer_append_char(struct buffer *b, unsigned char c) {
-	if (buffer_grow(b, 1) == -1) {
-		return -1;
-	}
-	b->buf[b->len++] = c;
-	return 0;
-}
+#include "hedley.h"
 
-static const char *buffer_str(struct buffer *b) {
-	if (!b->buf || b->len == 0) {
-		return NULL;
-	}
-	if (b->buf[b->len-1] != '\0') {
-		if (buffer_append_char(b, '\0') == -1) {
-			return NULL;
-		}
-	}
-	return b->buf;
-}
-*/
+#define PROGRAM_NAME "strip-ansi"
 
 // ANSI Parsing
 
@@ -103,6 +42,10 @@ static inline bool is_crtl_seq_start(unsigned char c) {
 	return c == '\\' || c == '[' || c == '(' || c == ')';
 }
 
+// The match_* functions return the length of the sequence at p, -1 if there
+// is none or ANSI_MORE if the end of p was reached before it was decided.
+#define ANSI_MORE -2
+
 HEDLEY_NON_NULL(1)
 static inline int match_operating_system_command(const unsigned char *p, int64_t length) {
 	int64_t i = 5;
@@ -115,8 +58,12 @@ static inline int match_operating_system_command(const unsigned char *p, int64_t
 		if (p[i] == '\x1b' && i < length-1 && p[i+1] == '\\') {
 			return i + 2;
 		}
+		if (p[i] == '\x1b' && i == length-1) {
+			return ANSI_MORE;
+		}
+		return -1;
 	}
-	return -1;
+	return ANSI_MORE;
 }
 
 HEDLEY_NON_NULL(1)
@@ -132,42 +79,211 @@ static inline int match_control_sequence(const unsigned char *p, int64_t length)
 		if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '@') {
 			return i + 1;
 		}
+		return -1;
 	}
-	return -1;
+	return ANSI_MORE;
+}
+
+// ANSI scanning
+//
+// ansi_scan returns the index of the first byte in s that may start an
+// escape sequence (`\x08`, `\x0e`, `\x0f` or `\x1b`), or n if there is none.
+// Most input is plain text so this is where most of the time is spent and
+// it has SIMD implementations that check 16 (SSE2, NEON) or 32 (AVX2) bytes
+// at a time. The implementation is selected on first use based on the
+// features supported by the CPU.
+//
+// `\x0e` and `\x0f` only differ in the low bit so they are matched with a
+// single comparison against `c | 1`.
+
+static inline bool is_ansi_start(unsigned char c) {
+	return c == '\x1b' || c == '\x08' || (c | 1) == '\x0f';
 }
 
 HEDLEY_NON_NULL(1)
-static inline int64_t has_ansi(const unsigned char *s) {
-	const unsigned char *p = s;
-	unsigned char c;
-	if (p) {
-		while ((c = *p++) != '\0') {
-			switch (c) {
-			case '\x0e':
-			case '\x0f':
-			case '\x1b':
-			case '\x08':
-				return p - s - 1;
-			}
+static int64_t ansi_scan_scalar(const unsigned char *s, int64_t n) {
+	for (int64_t i = 0; i < n; i++) {
+		if (is_ansi_start(s[i])) {
+			return i;
 		}
 	}
-	return -1;
+	return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((__target__("sse2")))
+HEDLEY_NON_NULL(1)
+static int64_t ansi_scan_sse2(const unsigned char *s, int64_t n) {
+	const __m128i esc = _mm_set1_epi8('\x1b');
+	const __m128i bs = _mm_set1_epi8('\x08');
+	const __m128i shift = _mm_set1_epi8('\x0f');
+	const __m128i one = _mm_set1_epi8(1);
+	int64_t i = 0;
+	for ( ; n - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)&s[i]);
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, esc), _mm_cmpeq_epi8(v, bs)),
+			_mm_cmpeq_epi8(_mm_or_si128(v, one), shift));
+		unsigned mask = _mm_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + ansi_scan_scalar(&s[i], n - i);
+}
+
+__attribute__((__target__("avx2")))
+HEDLEY_NON_NULL(1)
+static int64_t ansi_scan_avx2(const unsigned char *s, int64_t n) {
+	const __m256i esc = _mm256_set1_epi8('\x1b');
+	const __m256i bs = _mm256_set1_epi8('\x08');
+	const __m256i shift = _mm256_set1_epi8('\x0f');
+	const __m256i one = _mm256_set1_epi8(1);
+	int64_t i = 0;
+	for ( ; n - i >= 32; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)&s[i]);
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, esc), _mm256_cmpeq_epi8(v, bs)),
+			_mm256_cmpeq_epi8(_mm256_or_si256(v, one), shift));
+		unsigned mask = _mm256_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + ansi_scan_sse2(&s[i], n - i);
+}
+
+#elif defined(__aarch64__)
+
+HEDLEY_NON_NULL(1)
+static int64_t ansi_scan_neon(const unsigned char *s, int64_t n) {
+	const uint8x16_t esc = vdupq_n_u8('\x1b');
+	const uint8x16_t bs = vdupq_n_u8('\x08');
+	const uint8x16_t shift = vdupq_n_u8('\x0f');
+	const uint8x16_t one = vdupq_n_u8(1);
+	int64_t i = 0;
+	for ( ; n - i >= 16; i += 16) {
+		uint8x16_t v = vld1q_u8(&s[i]);
+		uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, esc), vceqq_u8(v, bs)),
+		                        vceqq_u8(vorrq_u8(v, one), shift));
+		// Narrow each byte of the mask to 4 bits
+		uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+		if (mask) {
+			return i + (__builtin_ctzll(mask) / 4);
+		}
+	}
+	return i + ansi_scan_scalar(&s[i], n - i);
+}
+
+#endif
+
+static int64_t ansi_scan_init(const unsigned char *s, int64_t n);
+
+static int64_t (*ansi_scan)(const unsigned char *s, int64_t n) = ansi_scan_init;
+
+static int64_t ansi_scan_init(const unsigned char *s, int64_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ansi_scan = ansi_scan_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		ansi_scan = ansi_scan_sse2;
+	} else {
+		ansi_scan = ansi_scan_scalar;
+	}
+#elif defined(__aarch64__)
+	ansi_scan = ansi_scan_neon;
+#else
+	ansi_scan = ansi_scan_scalar;
+#endif
+	return ansi_scan(s, n);
 }
 
 static inline bool rune_start(unsigned char c) {
 	return (c&0xC0) != 0x80;
 }
 
+// UTF-8 decoding
+//
+// Input is always decoded as UTF-8, regardless of the locale. utf8_first
+// describes the first byte of a sequence: the low nibble is the length of
+// the sequence (0 if the byte cannot start one) and the high nibble is the
+// index of the valid range of the second byte in utf8_accept, which
+// excludes overlong encodings, surrogates and runes above U+10FFFF.
+
+static const uint8_t utf8_first[256] = {
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x00
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x10
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x20
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x30
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x40
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x50
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x60
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 0x70
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x80
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x90
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xA0
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xB0
+	0x00, 0x00, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, // 0xC0
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, // 0xD0
+	0x13, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x23, 0x03, 0x03, // 0xE0
+	0x34, 0x04, 0x04, 0x04, 0x44, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xF0
+};
+
+static const struct {
+	uint8_t lo;
+	uint8_t hi;
+} utf8_accept[5] = {
+	{ 0x80, 0xBF },
+	{ 0xA0, 0xBF }, // 0xE0
+	{ 0x80, 0x9F }, // 0xED
+	{ 0x90, 0xBF }, // 0xF0
+	{ 0x80, 0x8F }, // 0xF4
+};
+
+#define UTF8_INCOMPLETE -1
+
+// utf8_decode returns the length of the UTF-8 sequence at p, 0 if it is
+// invalid or UTF8_INCOMPLETE if it is a valid prefix of a longer sequence.
+HEDLEY_NON_NULL(1)
+static inline int64_t utf8_decode(const unsigned char *p, int64_t length) {
+	uint8_t x = utf8_first[p[0]];
+	int64_t n = x & 0x7;
+	if (n <= 1) {
+		return n;
+	}
+	for (int64_t i = 1; i < n; i++) {
+		if (i == length) {
+			return UTF8_INCOMPLETE;
+		}
+		if (i == 1 ? p[1] < utf8_accept[x>>4].lo || utf8_accept[x>>4].hi < p[1]
+		           : (p[i]&0xC0) != 0x80) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+// decode_rune_in_string returns the length of the rune at p, invalid and
+// incomplete sequences are treated as a single byte.
 HEDLEY_NON_NULL(1)
-static int64_t decode_rune_in_string(const unsigned char *p, int64_t length) {
+static inline int64_t decode_rune_in_string(const unsigned char *p, int64_t length) {
 	if (length < 1) {
 		return 0;
 	}
-	mbstate_t mb = { 0 };
-	int64_t size = mbrlen((const char *)p, length, &mb);
+	int64_t size = utf8_decode(p, length);
 	return size > 0 ? size : 1;
 }
 
+// rune_incomplete returns true if p (of length bytes) starts with an
+// incomplete multibyte sequence that more input could complete.
+HEDLEY_NON_NULL(1)
+static inline bool rune_incomplete(const unsigned char *p, int64_t length) {
+	return length > 0 && utf8_decode(p, length) == UTF8_INCOMPLETE;
+}
+
 HEDLEY_NON_NULL(1)
 static int64_t decode_last_rune_in_string(const unsigned char *p, int64_t length) {
 	const int utf_max = 4;
@@ -199,115 +315,46 @@ static int64_t decode_last_rune_in_string(const unsigned char *p, int64_t length
 	return size;
 }
 
-HEDLEY_NON_NULL(1,3,4)
-static int next_ansi_escape_sequence(const char *s, int64_t length, int64_t *start, int64_t *end) {
-	const unsigned char *p = (const unsigned char *)s;
-	assert(start);
-	assert(end);
-	*start = -1;
-	*end = -1;
-
-	int64_t i = has_ansi(p);
-	if (i < 0) {
-		return -1;
+// match_escape_sequence returns the length of the escape sequence at p
+// (which must start with `\x1b`), -1 if there is none or ANSI_MORE if more
+// input is needed to decide (this is only possible if eof is false, in
+// which case p is the input read so far). ANSI_MORE is only returned when
+// a match runs out of input, so a complete sequence at the end of the
+// input is matched without waiting for more.
+HEDLEY_NON_NULL(1)
+static int64_t match_escape_sequence(const unsigned char *p, int64_t length, bool eof) {
+	if (length < 2) {
+		return eof ? -1 : ANSI_MORE;
 	}
 
-	for ( ; i < length; i++) {
-		switch (p[i]) {
-		case '\x08':
-			// backtrack to match: `.\x08`
-			if (i > 0 && p[i-1] != '\n') {
-				if (p[i-1] < RUNE_SELF) {
-					*start = i - 1;
-					*end = i + 1;
-					return 0;
-				}
-
-				int64_t n = decode_last_rune_in_string(p, i);
-				assert(n > 0);
-				if (n < 0) {
-					n = 0; // WARN
-				}
-				*start = i - n;
-				*end = i + 1;
-				return 0;
-			}
-			break;
-		case '\x1b':
-			// match: `\x1b[\\[()][0-9;]*[a-zA-Z@]`
-			if (i+2 < length && is_crtl_seq_start(p[i+1])) {
-				int64_t j = match_control_sequence(&p[i], length-i);
-				if (j != -1) {
-					*start = i;
-					*end = i + j;
-					return 0;
-				}
-			}
-
-			// match: `\x1b][0-9];[[:print:]]+(?:\x1b\\\\|\x07)`
-			if (i+5 < length && p[i+1] == ']' && is_numeric(p[i+2]) && p[i+3] == ';' && is_print(p[i+4])) {
-				int64_t j = match_operating_system_command(&p[i], length-i);
-				if (j != -1) {
-					*start = i;
-					*end = i + j;
-					return 0;
-				}
-			}
-
-			// match: `\x1b.`
-			if (i+1 < length && p[i+1] != '\n') {
-				if (p[i+1] < RUNE_SELF) {
-					*start = i;
-					*end = i + 2;
-					return 0;
-				}
-
-				int64_t n = decode_rune_in_string(&p[i+1], length-(i+1));
-				*start = i;
-				*end = i + n + 1;
-				return 0;
-			}
-			break;
-		case '\x0e':
-		case '\x0f':
-			// match: `[\x0e\x0f]`
-			*start = i;
-			*end = i + 1;
-			return 0;
+	// match: `\x1b[\\[()][0-9;]*[a-zA-Z@]`
+	if (is_crtl_seq_start(p[1])) {
+		int64_t j = 2 < length ? match_control_sequence(p, length) : ANSI_MORE;
+		if (j >= 0 || (j == ANSI_MORE && !eof)) {
+			return j;
 		}
 	}
 
-	return -1;
-}
+	// match: `\x1b][0-9];[[:print:]]+(?:\x1b\\\\|\x07)`
+	if (p[1] == ']' && (length < 3 || is_numeric(p[2])) && (length < 4 || p[3] == ';') &&
+	    (length < 5 || is_print(p[4]))) {
+		int64_t j = 5 < length ? match_operating_system_command(p, length) : ANSI_MORE;
+		if (j >= 0 || (j == ANSI_MORE && !eof)) {
+			return j;
+		}
+	}
 
-HEDLEY_NON_NULL(1,3)
-static int strip_ansi(const char *s, int64_t length, struct buffer *b) {
-	int64_t start, end;
-	int64_t prev = 0;
-	int i = 0;
-	while (i < length) {
-		int rc = next_ansi_escape_sequence(&s[i], length-i, &start, &end);
-		// fprintf(stderr, "i: %i start: %lli end: %lli\n", i, start, end); // WARN
-		if (rc == -1 || start == -1) {
-			break;
+	// match: `\x1b.`
+	if (p[1] != '\n') {
+		if (p[1] < RUNE_SELF) {
+			return 2;
 		}
-		start += i;
-		i += end;
-		if (start-prev > 0) {
-			// fprintf(stderr, "writing: %lli\n", start); // WARN
-			if (buffer_write(b, &s[prev], start-prev) == -1) {
-				return -1;
-			}
+		if (!eof && rune_incomplete(&p[1], length-1)) {
+			return ANSI_MORE;
 		}
-		prev = i;
+		return decode_rune_in_string(&p[1], length-1) + 1;
 	}
-	if (prev == 0) {
-		// no ANSI escape sequences found
-		buffer_write(b, s, length); // copy whole string
-	} else {
-		buffer_write(b, &s[prev], length-prev);
-	}
-	return 0;
+	return -1;
 }
 
 HEDLEY_NON_NULL(2)
@@ -315,118 +362,519 @@ static int read_ignoring_eintrio(int fd, void *buf, size_t size) {
 	int n;
 	do {
 		n = read(fd, buf, size);
-	} while (errno == EINTR);
+	} while (n == -1 && errno == EINTR);
 	return n;
 }
 
 HEDLEY_NON_NULL(2)
-static int write_ignoring_eintrio(int fd, void *buf, size_t size) {
+static int write_ignoring_eintrio(int fd, const void *buf, size_t size) {
 	int n;
 	do {
 		n = write(fd, buf, size);
-	} while (errno == EINTR);
+	} while (n == -1 && errno == EINTR);
 	return n;
 }
 
-static int process_fildes(int fd_in, int fd_out, int benchmark) {
-	struct buffer b = { 0 };
+HEDLEY_NON_NULL(2)
+static ssize_t writev_ignoring_eintrio(int fd, const struct iovec *iov, int iovcnt) {
+	ssize_t n;
+	do {
+		n = writev(fd, iov, iovcnt);
+	} while (n == -1 && errno == EINTR);
+	return n;
+}
 
-	const int64_t min_read = 512;
-	int64_t cap = 32 * 1024;
-	assert(cap > min_read); // sanity check
+// Output
+//
+// The text between escape sequences is written straight from the input
+// buffer with writev. Spans shorter than SPAN_COPY_MAX are instead appended
+// to the previous span so that text with many short escape sequences (e.g.
+// colored `ls` output) is not written as tiny iovecs. If the input buffer
+// is writable (in_place) they are moved to the end of the previous span,
+// otherwise (a mapped file) they are copied to the stage buffer so that
+// only the text around escape sequences is ever copied. If out is set all
+// text is instead copied to it (used by the parallel workers).
+
+#define SPAN_IOV_MAX    1024
+#define SPAN_COPY_MAX   256
+#define SPAN_STAGE_SIZE (64 * 1024)
+
+struct span_writer {
+	int          fd;
+	bool         in_place;
+	char         *out;
+	size_t       out_len;
+	int          iovcnt;
+	size_t       stage_len;
+	struct iovec iov[SPAN_IOV_MAX];
+	char         stage[SPAN_STAGE_SIZE];
+};
 
-	char *buf = malloc(cap);
-	assert(buf);
-	char *p = buf;
+HEDLEY_NON_NULL(1)
+static int span_flush(struct span_writer *w) {
+	struct iovec *iov = w->iov;
+	int iovcnt = w->iovcnt;
+	while (iovcnt > 0) {
+		ssize_t n = writev_ignoring_eintrio(w->fd, iov, iovcnt);
+		if (n == -1) {
+			perror("write");
+			return -1;
+		}
+		// Skip what was written
+		for ( ; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--) {
+			n -= iov->iov_len;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	w->iovcnt = 0;
+	w->stage_len = 0;
+	return 0;
+}
 
-	ssize_t n;
-	while (1) {
-		int64_t len = p - buf;
-		if ((cap - len) < min_read) {
-			char *new_buf = realloc(buf, cap * 2);
-			assert(new_buf);
-			if (!new_buf) {
-				goto error;
+HEDLEY_NON_NULL(1,2)
+static int span_write(struct span_writer *w, const char *p, int64_t len) {
+	if (len == 0) {
+		return 0;
+	}
+	if (w->out) {
+		memcpy(&w->out[w->out_len], p, len);
+		w->out_len += len;
+		return 0;
+	}
+	if (w->iovcnt > 0) {
+		struct iovec *last = &w->iov[w->iovcnt-1];
+		char *end = (char *)last->iov_base + last->iov_len;
+		if (end == p) {
+			last->iov_len += len;
+			return 0;
+		}
+		if (len < SPAN_COPY_MAX && (w->in_place ||
+		    (end == &w->stage[w->stage_len] && w->stage_len+len <= SPAN_STAGE_SIZE))) {
+			memmove(end, p, len);
+			last->iov_len += len;
+			if (!w->in_place) {
+				w->stage_len += len;
 			}
-			cap *= 2;
-			buf = new_buf;
-			p = &buf[len];
+			return 0;
+		}
+	}
+	bool stage = len < SPAN_COPY_MAX && !w->in_place;
+	if (w->iovcnt == SPAN_IOV_MAX || (stage && w->stage_len+len > SPAN_STAGE_SIZE)) {
+		if (span_flush(w) == -1) {
+			return -1;
 		}
-		if ((n = read_ignoring_eintrio(fd_in, p, cap-len)) <= 0) {
+	}
+	if (stage) {
+		memcpy(&w->stage[w->stage_len], p, len);
+		p = &w->stage[w->stage_len];
+		w->stage_len += len;
+	}
+	w->iov[w->iovcnt].iov_base = (void *)(uintptr_t)p;
+	w->iov[w->iovcnt].iov_len = len;
+	w->iovcnt++;
+	return 0;
+}
+
+// Number of bytes at the end of the input that are held back until more
+// input is read since a following backspace (`.\x08`) removes the rune
+// before it (decode_last_rune_in_string looks at most 5 bytes back). The
+// rune never crosses a newline so nothing after a newline is held back.
+#define STRIP_LOOKBEHIND 8
+
+// strip_ansi removes all ANSI escape sequences from s in a single pass,
+// writing the remaining text to w, and returns the number of bytes of s
+// that were consumed or -1 on error. Unless eof is true the rest of s (an
+// incomplete escape sequence or the last few bytes of the input) must be
+// passed again followed by more input. The spans added to w point into s
+// so it must be flushed before s is reused.
+//
+// A backspace only removes the rune before it if that rune follows the
+// end of the previous match (prev) and is not a newline.
+HEDLEY_NON_NULL(1,4)
+static int64_t strip_ansi(const char *s, int64_t length, bool eof, struct span_writer *w) {
+	const unsigned char *p = (const unsigned char *)s;
+	int64_t prev = 0; // end of the last match
+	int64_t cut = -1;
+	for (int64_t i = 0; i < length; ) {
+		i += ansi_scan(&p[i], length - i);
+		if (i == length) {
 			break;
 		}
-		p += n;
-	};
-	if (n < 0) {
-		perror("read");
-		goto error;
+		int64_t start = i;
+		int64_t n = -1;
+		switch (p[i]) {
+		case '\x08':
+			// backtrack to match: `.\x08`
+			if (i > prev && p[i-1] != '\n') {
+				start = i - (p[i-1] < RUNE_SELF ? 1 : decode_last_rune_in_string(&p[prev], i-prev));
+				n = 1;
+			}
+			break;
+		case '\x1b':
+			n = match_escape_sequence(&p[i], length-i, eof);
+			if (n == ANSI_MORE) {
+				cut = i; // incomplete escape sequence
+			}
+			break;
+		case '\x0e':
+		case '\x0f':
+			// match: `[\x0e\x0f]`
+			n = 1;
+			break;
+		}
+		if (cut != -1) {
+			break;
+		}
+		if (n < 0) {
+			i++;
+			continue;
+		}
+		if (span_write(w, &s[prev], start-prev) == -1) {
+			return -1;
+		}
+		prev = i = i + n;
+	}
+	if (cut == -1) {
+		cut = length;
+		if (!eof) {
+			int64_t lim = length-STRIP_LOOKBEHIND > prev ? length-STRIP_LOOKBEHIND : prev;
+			for ( ; cut > lim && s[cut-1] != '\n'; cut--) {
+			}
+		}
+	}
+	if (span_write(w, &s[prev], cut-prev) == -1) {
+		return -1;
 	}
-	p[0] = '\0';
+	return cut;
+}
 
-	buffer_grow(&b, p-buf);
+// Parallel stripping
+//
+// With `-j N` mapped files of at least PARALLEL_MIN_SIZE bytes are split
+// into chunks of about PARALLEL_CHUNK_SIZE bytes that end at a newline.
+// No escape sequence contains a newline and a backspace never removes one
+// so each chunk can be stripped on its own. Worker threads claim chunks in
+// order and strip them into one of 2*N slots; the calling thread writes the
+// slots in order and frees them for reuse, which bounds memory use.
+
+#ifndef PARALLEL_CHUNK_SIZE
+#define PARALLEL_CHUNK_SIZE (1024 * 1024)
+#endif
+#define PARALLEL_MIN_SIZE   (4 * PARALLEL_CHUNK_SIZE)
+#define PARALLEL_MAX_JOBS   256
+
+struct parallel_slot {
+	const char *data; // stripped chunk (out or the chunk itself)
+	size_t     len;
+	char       *out;
+	size_t     cap;
+	bool       done;
+};
 
-	if (benchmark <= 0) {
-		if (strip_ansi(buf, p-buf, &b) == -1) {
-			goto error;
+struct parallel_strip {
+	pthread_mutex_t      mu;
+	pthread_cond_t       cond; // a chunk was stripped or a slot was freed
+	const char           *p;
+	size_t               size;
+	size_t               off;     // start of the next unclaimed chunk
+	size_t               claimed; // number of chunks claimed by workers
+	size_t               written; // number of chunks written
+	bool                 stop;
+	bool                 failed;
+	size_t               nslots;
+	struct parallel_slot *slots;
+};
+
+static void *parallel_strip_worker(void *arg) {
+	struct parallel_strip *ps = arg;
+	struct span_writer *w = calloc(1, sizeof(*w));
+	if (!w) {
+		perror("calloc");
+	}
+
+	pthread_mutex_lock(&ps->mu);
+	while (w) {
+		while (!ps->stop && ps->off < ps->size && ps->claimed-ps->written == ps->nslots) {
+			pthread_cond_wait(&ps->cond, &ps->mu);
+		}
+		if (ps->stop || ps->off == ps->size) {
+			break;
+		}
+		struct parallel_slot *slot = &ps->slots[ps->claimed % ps->nslots];
+		const char *p = &ps->p[ps->off];
+		size_t len = ps->size - ps->off;
+		if (len > PARALLEL_CHUNK_SIZE) {
+			const char *nl = memchr(&p[PARALLEL_CHUNK_SIZE-1], '\n', len-(PARALLEL_CHUNK_SIZE-1));
+			if (nl) {
+				len = nl - p + 1;
+			}
 		}
+		ps->off += len;
+		ps->claimed++;
+		slot->done = false;
+		pthread_mutex_unlock(&ps->mu);
+
+		bool ok = true;
+		if (ansi_scan((const unsigned char *)p, len) == (int64_t)len) {
+			// Nothing to strip: write the chunk from the mapping
+			slot->data = p;
+			slot->len = len;
+		} else {
+			if (slot->cap < len) {
+				free(slot->out);
+				slot->out = malloc(len);
+				slot->cap = slot->out ? len : 0;
+			}
+			if (slot->out) {
+				w->out = slot->out;
+				w->out_len = 0;
+				strip_ansi(p, len, true, w);
+				slot->data = slot->out;
+				slot->len = w->out_len;
+			} else {
+				perror("malloc");
+				ok = false;
+			}
+		}
+
+		pthread_mutex_lock(&ps->mu);
+		if (!ok) {
+			ps->stop = true;
+			ps->failed = true;
+		}
+		slot->done = true;
+		pthread_cond_broadcast(&ps->cond);
+	}
+	if (!w) {
+		ps->stop = true;
+		ps->failed = true;
+		pthread_cond_broadcast(&ps->cond);
+	}
+	pthread_mutex_unlock(&ps->mu);
+	free(w);
+	return NULL;
+}
+
+static int process_parallel(const char *p, size_t size, int fd_out, long jobs) {
+	pthread_t threads[PARALLEL_MAX_JOBS];
+	struct parallel_strip ps = {
+		.mu     = PTHREAD_MUTEX_INITIALIZER,
+		.cond   = PTHREAD_COND_INITIALIZER,
+		.p      = p,
+		.size   = size,
+		.nslots = 2 * jobs,
+	};
+	ps.slots = calloc(ps.nslots, sizeof(*ps.slots));
+	if (!ps.slots) {
+		perror("calloc");
+		return 1;
+	}
+	long started = 0;
+	for ( ; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, parallel_strip_worker, &ps) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		perror("pthread_create");
+		ps.failed = true;
+	}
+
+	pthread_mutex_lock(&ps.mu);
+	while (started > 0 && (ps.written < ps.claimed || ps.off < ps.size)) {
+		struct parallel_slot *slot = &ps.slots[ps.written % ps.nslots];
+		while (!ps.stop && !(ps.written < ps.claimed && slot->done)) {
+			pthread_cond_wait(&ps.cond, &ps.mu);
+		}
+		if (ps.stop) {
+			break;
+		}
+		pthread_mutex_unlock(&ps.mu);
 		size_t off = 0;
-		while (off < b.len) {
-			n = write_ignoring_eintrio(fd_out, &b.buf[off], b.len-off);
+		while (off < slot->len) {
+			ssize_t n = write_ignoring_eintrio(fd_out, &slot->data[off], slot->len-off);
 			if (n == -1) {
 				perror("write");
-				goto error;
+				break;
 			}
 			off += n;
 		}
+		pthread_mutex_lock(&ps.mu);
+		if (off < slot->len) {
+			ps.stop = true;
+			ps.failed = true;
+		}
+		ps.written++;
+		pthread_cond_broadcast(&ps.cond);
+	}
+	pthread_mutex_unlock(&ps.mu);
+
+	for (long i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for (size_t i = 0; i < ps.nslots; i++) {
+		free(ps.slots[i].out);
+	}
+	free(ps.slots);
+	return ps.failed ? 1 : 0;
+}
+
+// Regular files are mapped and stripped in one pass, so the text between
+// escape sequences is written straight from the page cache.
+// process_mapped strips the size bytes of fd_in starting at offset off
+// (which need not be page aligned).
+static int process_mapped(int fd_in, off_t off, size_t size, struct span_writer *w, long jobs) {
+	const off_t page = (off_t)sysconf(_SC_PAGESIZE);
+	const size_t delta = page > 0 ? (size_t)(off % page) : 0;
+	char *base = mmap(NULL, size + delta, PROT_READ, MAP_PRIVATE, fd_in, off - (off_t)delta);
+	if (base == MAP_FAILED) {
+		return -1;
+	}
+	char *p = base + delta;
+	int rc = 0;
+	if (jobs > 1 && size >= PARALLEL_MIN_SIZE) {
+		rc = process_parallel(p, size, w->fd, jobs);
 	} else {
-		for (int i = 0; i < benchmark; i++) {
-			buffer_reset(&b);
-			if (strip_ansi(buf, p-buf, &b) == -1) {
+		w->in_place = false;
+		if (strip_ansi(p, size, true, w) == -1 || span_flush(w) == -1) {
+			rc = 1;
+		}
+	}
+	munmap(base, size + delta);
+	return rc;
+}
+
+// Input is stripped in chunks of up to STRIP_BUFFER_SIZE bytes, which are
+// written as soon as they are read, so memory use is constant and output
+// is not delayed (e.g. `tail -f | strip-ansi`). Escape sequences that are
+// longer than the buffer are handled as if the input ended after them.
+// The read buffer is the only allocation.
+#ifndef STRIP_BUFFER_SIZE
+#define STRIP_BUFFER_SIZE (64 * 1024)
+#endif
+
+static int process_fildes(int fd_in, int fd_out, long jobs) {
+	static struct span_writer w;
+	w.fd = fd_out;
+	w.iovcnt = 0;
+	w.stage_len = 0;
+
+	// Map regular files from the current offset (e.g. stdin may have been
+	// partly consumed by a previous command) and leave the offset at the
+	// end of what was stripped, as reading would.
+	struct stat st;
+	off_t off;
+	if (fstat(fd_in, &st) == 0 && S_ISREG(st.st_mode) &&
+	    (off = lseek(fd_in, 0, SEEK_CUR)) != -1 && off < st.st_size &&
+	    (uint64_t)(st.st_size - off) <= SIZE_MAX) {
+		int rc = process_mapped(fd_in, off, st.st_size - off, &w, jobs);
+		if (rc != -1) {
+			lseek(fd_in, st.st_size, SEEK_SET);
+			return rc;
+		}
+		// Fallback to reading the file if it cannot be mapped
+	}
+
+	char *buf = malloc(STRIP_BUFFER_SIZE);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+	w.in_place = true;
+
+	int64_t len = 0;
+	bool eof = false;
+	while (!eof) {
+		// If the unused input fills the buffer strip it as-is
+		bool full = len == STRIP_BUFFER_SIZE;
+		ssize_t n = 0;
+		if (!full) {
+			n = read_ignoring_eintrio(fd_in, &buf[len], STRIP_BUFFER_SIZE-len);
+			if (n < 0) {
+				perror("read");
 				goto error;
 			}
-			size_t off = 0;
-			while (off < b.len) {
-				n = write_ignoring_eintrio(fd_out, &b.buf[off], b.len-off);
-				if (n == -1) {
-					perror("write");
-					goto error;
-				}
-				off += n;
-			}
+			len += n;
+			eof = n == 0;
 		}
+
+		int64_t used = strip_ansi(buf, len, eof || full, &w);
+		if (used == -1 || span_flush(&w) == -1) {
+			goto error;
+		}
+		// Keep the unused input (if any) for the next pass
+		len -= used;
+		memmove(buf, &buf[used], len);
 	}
 
 	free(buf);
-	buffer_free(&b);
 	return 0;
 
 error:
 	free(buf);
-	buffer_free(&b);
 	return 1;
 }
 
+static inline bool is_jobs_flag(const char *arg) {
+	return strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0;
+}
+
 int main(int argc, char const *argv[]) {
 	// TODO: close stdout on exit
-	setlocale(LC_ALL, "");
-	const int benchmark = 0;
 
-	if (argc <= 1 || strcmp(argv[1], "-") == 0) {
-		if (process_fildes(STDIN_FILENO, STDOUT_FILENO, benchmark) == -1) {
+	long jobs = 1;
+	int nfiles = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!is_jobs_flag(argv[i])) {
+			nfiles++;
+			continue;
+		}
+		if (i + 1 == argc) {
+			fprintf(stderr, "%s: missing argument to '%s' flag\n",
+				PROGRAM_NAME, argv[i]);
+			return 1;
+		}
+		char *end;
+		const char *arg = argv[++i];
+		jobs = strtol(arg, &end, 10);
+		if (end == arg || *end != '\0' || jobs < 1 || jobs > PARALLEL_MAX_JOBS) {
+			fprintf(stderr, "%s: invalid number of jobs: '%s'\n",
+				PROGRAM_NAME, arg);
+			return 1;
+		}
+	}
+
+	if (nfiles == 0) {
+		if (process_fildes(STDIN_FILENO, STDOUT_FILENO, jobs) != 0) {
 			return 1;
 		}
 	}
 	for (int i = 1; i < argc; i++) {
-		 int fd = open(argv[i], O_RDONLY);
-		 if (fd < 0) {
-		 	perror("open");
-		 	fprintf(stderr, "error opening file: %s\n", argv[i]);
-		 	return 1;
-		 }
-		 if (process_fildes(fd, STDOUT_FILENO, benchmark) == -1) {
-		 	fprintf(stderr, "error processing file: %s\n", argv[i]);
-		 	return 1;
-		 }
+		if (is_jobs_flag(argv[i])) {
+			i++;
+			continue;
+		}
+		if (strcmp(argv[i], "-") == 0) {
+			if (process_fildes(STDIN_FILENO, STDOUT_FILENO, jobs) != 0) {
+				return 1;
+			}
+			continue;
+		}
+		int fd = open(argv[i], O_RDONLY);
+		if (fd < 0) {
+			perror("open");
+			fprintf(stderr, "error opening file: %s\n", argv[i]);
+			return 1;
+		}
+		if (process_fildes(fd, STDOUT_FILENO, jobs) != 0) {
+			fprintf(stderr, "error processing file: %s\n", argv[i]);
+			close(fd);
+			return 1;
+		}
+		close(fd);
 	}
 	return 0;
 }
@@ -0,0 +1,107 @@
+#!/usr/bin/env bash
+
+set -euo pipefail
+
+# DIR is the project root directory
+DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" >/dev/null 2>&1 && pwd)/.."
+cd "$DIR"
+
+if [ -t 1 ]; then
+    RED=$'\E[00;31m'
+    GREEN=$'\E[00;32m'
+    YELLOW=$'\E[00;33m'
+    RESET=$'\E[0m'
+else
+    RED=''
+    GREEN=''
+    YELLOW=''
+    RESET=''
+fi
+EXIT_CODE=0
+TESTNAME=''
+
+trap 'echo "${RED}# test:${RESET} ${YELLOW}${TESTNAME}${RESET} failed"' ERR
+
+function _test() {
+    TESTNAME="$1"
+    echo "${GREEN}# test:${RESET}" "$1"
+}
+
+function _error() {
+    echo "${YELLOW}error:${RESET}" "$@"
+    ((EXIT_CODE++))
+}
+
+function _fatal() {
+    echo "${YELLOW}error:${RESET}" "$@"
+    return 1
+}
+
+_test 'build'
+make build
+
+STRIP_ANSI="${DIR}/strip-ansi"
+[[ ! -x "${STRIP_ANSI}" ]] && {
+    _fatal "missing strip-ansi executable: ${STRIP_ANSI}"
+}
+
+_test 'strip'
+diff <(printf '%s\n' 'red' 'bold blue' 'title') <(printf '%b\n' \
+    '\e[31mred\e[0m' '\e[01;34mbold blue\e[0m' '\e]0;xterm\atitle' |
+    "${STRIP_ANSI}") || _error "failed: ${TESTNAME}"
+
+# A complete escape sequence at the end of a read must be written without
+# waiting for more input.
+_test 'stream (no delay)'
+LINE=''
+if ! IFS= read -r -t 2 LINE < <({ printf 'a\e[0m\n'; sleep 5; } | "${STRIP_ANSI}") ||
+    [[ "${LINE}" != 'a' ]]; then
+    _error "failed: ${TESTNAME}: no complete line within 2s (got '${LINE}')"
+fi
+
+# Sequences split across reads are carried over to the next read and
+# stripped in place once complete.
+_test 'stream (split sequences)'
+diff <(printf '%s\n' 'red' 'title' 'blue') <({
+    printf '\e['
+    sleep 0.2
+    printf '31mred\e[0m\n\e]0;xt'
+    sleep 0.2
+    printf 'erm\atitle\n\e[01;3'
+    sleep 0.2
+    printf '4mblue\e'
+    sleep 0.2
+    printf '[0m\n'
+} | "${STRIP_ANSI}") || _error "failed: ${TESTNAME}"
+
+# A sequence completed by a later read is not held back once it is complete.
+_test 'stream (completed sequence)'
+LINE=''
+if ! IFS= read -r -t 2 LINE < <({
+    printf 'b\e[0'
+    sleep 0.2
+    printf 'm\n'
+    sleep 5
+} | "${STRIP_ANSI}") || [[ "${LINE}" != 'b' ]]; then
+    _error "failed: ${TESTNAME}: no complete line within 2s (got '${LINE}')"
+fi
+
+# Regular files are mapped: stdin that was partly consumed by a previous
+# command must be stripped from its current offset.
+_test 'stdin (partly consumed)'
+PARTIAL_TEST="$(mktemp)"
+printf '%b\n' 'line1' '\e[31mline2\e[0m' 'line3' >"${PARTIAL_TEST}"
+diff <(printf '%s\n' 'line2' 'line3' 'EOF') <({
+    head -n 1 >/dev/null
+    "${STRIP_ANSI}"
+    cat
+    echo 'EOF'
+} <"${PARTIAL_TEST}") || _error "failed: ${TESTNAME}"
+rm "${PARTIAL_TEST}"
+
+if ((EXIT_CODE == 0)); then
+    _test 'PASS'
+else
+    _error "FAIL: ${EXIT_CODE} tests failed"
+fi
+exit $EXIT_CODE